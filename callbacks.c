@@ -73,23 +73,23 @@ webfw2_header_cb(apr_pool_t * pool, void *fc_data, const void **userdata)
 
 void
 webfw2_register_callbacks(apr_pool_t * pool, webfw2_config_t * config,
-                          webfw2_filter_t * filter)
+                          filter_t * filter)
 {
     int             i;
     char          **list;
 
-    filter_register_user_cb(filter->filter,
+    filter_register_user_cb(filter,
                             (void *) webfw2_srcaddr_cb, RULE_MATCH_SRCADDR,
                             NULL);
 
-    filter_register_user_cb(filter->filter, (void *) webfw2_dstaddr_cb,
+    filter_register_user_cb(filter, (void *) webfw2_dstaddr_cb,
                             RULE_MATCH_DSTADDR, NULL);
 
     if (config->match_header) {
         list = (char **) config->match_header->elts;
 
         for (i = 0; i < config->match_header->nelts; i++)
-            filter_register_user_cb(filter->filter,
+            filter_register_user_cb(filter,
                                     (void *) webfw2_header_cb,
                                     RULE_MATCH_STRING, list[i]);
     }
@@ -98,7 +98,7 @@ webfw2_register_callbacks(apr_pool_t * pool, webfw2_config_t * config,
         list = (char **) config->match_note->elts;
 
         for (i = 0; i < config->match_note->nelts; i++)
-            filter_register_user_cb(filter->filter,
+            filter_register_user_cb(filter,
                                     (void *) webfw2_note_cb,
                                     RULE_MATCH_STRING, list[i]);
     }
@@ -107,7 +107,7 @@ webfw2_register_callbacks(apr_pool_t * pool, webfw2_config_t * config,
         list = (char **) config->match_env->elts;
 
         for (i = 0; i < config->match_env->nelts; i++)
-            filter_register_user_cb(filter->filter, (void *) webfw2_env_cb,
+            filter_register_user_cb(filter, (void *) webfw2_env_cb,
                                     RULE_MATCH_STRING, list[i]);
     }
 }
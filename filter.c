@@ -18,11 +18,9 @@
 #include <unistd.h>
 #include <regex.h>
 #include "filter.h"
+#include "filter_index.h"
 #include "confuse.h"
 
-
-#define REGEX_KEY "$_R_$_E_$_G_$_X_$"
-
 static struct n_t_s {
     int             val;
     const char     *strval;
@@ -42,9 +40,9 @@ static struct n_t_s {
 int
 filter_validate_ip(char *addrstr)
 {
-    struct in_addr  sa;
+    u_char          sa[4];
 
-    if (inet_pton(AF_INET, addrstr, &sa))
+    if (patricia_parse_ipv4(addrstr, strlen(addrstr), sa, 1))
         return 1;
 
     PRINT_DEBUG("%s is not a valid IP address!\n", addrstr);
@@ -157,121 +155,253 @@ filter_tokenize_str(char *string, const char *sep, int *nelts)
 }
 
 rule_flow_t    *
-filter_rule_flow_init(apr_pool_t * pool)
+filter_rule_flow_init(apr_pool_t * pool, int nflows)
 {
     return (rule_flow_t *)
-        apr_pcalloc(pool, sizeof(rule_flow_t));
+        apr_pcalloc(pool, sizeof(rule_flow_t) * nflows);
+}
+
+/*
+ * what one of a rule's load-time trees says about an address: the data of
+ * its longest prefix holding it, FILTER_RULE_IP_ADD or FILTER_RULE_IP_SUB,
+ * or NULL when there is none. The filter's index already answered this
+ * for every rule when the address was fetched. 
+ */
+#define FILTER_RULE_IP_NONE    (void *)-1
+
+static void    *
+filter_search_tree(filter_rule_t * rule, patricia_tree_t * tree,
+                   filter_addr_t * addr)
+{
+    patricia_node_t *pnode;
+
+    if (!tree || !addr)
+        return FILTER_RULE_IP_NONE;
+
+    if (addr->add) {
+        if (FILTER_INDEX_TEST(addr->add, rule->id))
+            return FILTER_RULE_IP_ADD;
+        if (FILTER_INDEX_TEST(addr->sub, rule->id))
+            return FILTER_RULE_IP_SUB;
+        return FILTER_RULE_IP_NONE;
+    }
+
+    if (!(pnode = patricia_search_best_addr(tree, addr->addr, addr->bitlen)))
+        return FILTER_RULE_IP_NONE;
+
+    return pnode->data;
+}
+
+/*
+ * search the source addresses of a rule. Addresses added at runtime by an
+ * update-rule are always host prefixes, so a hit there is the longest
+ * possible match and wins over anything in the load-time tree.
+ */
+static void    *
+filter_search_srcaddr(filter_rule_t * rule, filter_addr_t * addr,
+                      int *have_addrs)
+{
+    filter_dynamic_t *dynamic;
+    patricia_node_t *pnode;
+
+    pnode = NULL;
+    dynamic = rule->dynamic;
+    *have_addrs = rule->src_addrs != NULL;
+
+    if (dynamic) {
+#ifdef APR_HAS_THREADS
+        apr_thread_rwlock_rdlock(dynamic->rwlock);
+#endif
+        if (dynamic->src_addrs->head) {
+            *have_addrs = 1;
+            if (addr)
+                pnode = patricia_search_best_addr(dynamic->src_addrs,
+                                                  addr->addr, addr->bitlen);
+        }
+#ifdef APR_HAS_THREADS
+        apr_thread_rwlock_unlock(dynamic->rwlock);
+#endif
+        if (pnode)
+            return pnode->data;
+    }
+
+    return filter_search_tree(rule, rule->src_addrs, addr);
 }
 
 static int
 filter_match_srcaddr(apr_pool_t * pool, filter_rule_t * rule, void *data,
-                     void *usrdata)
+                     rule_flow_t * flow)
 {
-    patricia_node_t *pnode;
+    void           *found;
+    int             have_addrs;
 
-    if (!rule->src_addrs)
-        return 1;
+    found = filter_search_srcaddr(rule, (filter_addr_t *) data,
+                                  &have_addrs);
 
-    if ((pnode = try_search_best(pool, rule->src_addrs, (char *) data)))
-        return pnode->data == FILTER_RULE_IP_ADD;
+    if (!have_addrs)
+        return 1;
 
-    return 0;
+    return found == FILTER_RULE_IP_ADD;
 }
 
 static int
 filter_match_not_dstaddr(apr_pool_t * pool, filter_rule_t * rule,
-                         void *data, void *usrdata)
+                         void *data, rule_flow_t * flow)
 {
-    patricia_node_t *pnode;
+    void           *found;
 
     if (!rule->dst_addrs)
         return 1;
 
-    if ((pnode = try_search_best(pool, rule->dst_addrs, (char *) data)))
-        return pnode->data == FILTER_RULE_IP_SUB;
+    found = filter_search_tree(rule, rule->dst_addrs, (filter_addr_t *) data);
+
+    if (found != FILTER_RULE_IP_NONE)
+        return found == FILTER_RULE_IP_SUB;
 
     return 1;
 }
 
 static int
 filter_match_not_srcaddr(apr_pool_t * pool, filter_rule_t * rule,
-                         void *data, void *usrdata)
+                         void *data, rule_flow_t * flow)
 {
-    patricia_node_t *pnode;
+    void           *found;
+    int             have_addrs;
 
-    if (!rule->src_addrs)
+    found = filter_search_srcaddr(rule, (filter_addr_t *) data,
+                                  &have_addrs);
+
+    if (!have_addrs)
         return 1;
 
-    if ((pnode = try_search_best(pool, rule->src_addrs, (char *) data)))
-        return pnode->data == FILTER_RULE_IP_SUB;
+    if (found != FILTER_RULE_IP_NONE)
+        return found == FILTER_RULE_IP_SUB;
 
     return 1;
 }
 
 static int
 filter_match_dstaddr(apr_pool_t * pool, filter_rule_t * rule, void *data,
-                     void *usrdata)
+                     rule_flow_t * flow)
 {
-    patricia_node_t *pnode;
-
     if (!rule->dst_addrs)
         return 1;
 
-    if ((pnode = try_search_best(pool, rule->dst_addrs, (char *) data)))
-        return pnode->data == FILTER_RULE_IP_ADD;
+    return filter_search_tree(rule, rule->dst_addrs,
+                              (filter_addr_t *) data) == FILTER_RULE_IP_ADD;
+}
+
+static int
+filter_match_string_regex(apr_pool_t * pool, rule_flow_t * flow,
+                          const char *val)
+{
+    apr_array_header_t *regex_array = flow->regexes;
+    int             i;
+
+    /*
+     * all of the group's regexes in a single pass 
+     */
+    if (flow->regset)
+        return regset_match(flow->regset, val, pool);
+
+    for (i = 0; i < regex_array->nelts; i++) {
+        filter_regex_t *regex = ((filter_regex_t **) regex_array->elts)[i];
+        regex_t        *tomatch = &regex->regex;
+
+        if (regex->literal && !strstr(val, regex->literal))
+            continue;
+
+        PRINT_DEBUG("Comparing value %s to %p\n", val, tomatch);
+
+        if (regexec(tomatch, val, 0, NULL, 0) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int
+filter_match_string_fixed(rule_flow_t * flow, const strset_key_t * key)
+{
+    apr_array_header_t *fixed = flow->fixed;
+    const char     *val = key->str;
+    size_t          len = key->len;
+    int             i;
+
+    /*
+     * all of the group's fixed strings in a single pass 
+     */
+    if (flow->strmatch)
+        return strmatch_match(flow->strmatch, val);
+
+    for (i = 0; i < fixed->nelts; i++) {
+        filter_fixed_t *f = &((filter_fixed_t *) fixed->elts)[i];
+        size_t          flen = strlen(f->string);
+
+        switch (f->type) {
+        case FILTER_STRING_CONTAINS:
+            if (strstr(val, f->string))
+                return 1;
+            break;
+        case FILTER_STRING_PREFIX:
+            if (!strncmp(val, f->string, flen))
+                return 1;
+            break;
+        case FILTER_STRING_SUFFIX:
+            if (flen <= len && !strcmp(val + len - flen, f->string))
+                return 1;
+            break;
+        }
+    }
 
     return 0;
 }
 
 static int
 filter_match_string(apr_pool_t * pool,
-                    filter_rule_t * rule, void *val, void *key)
+                    filter_rule_t * rule, void *data, rule_flow_t * flow)
 {
-    apr_hash_t     *string_hash;
+    filter_string_t *str = data;
+    strset_key_t   *key;
 
+    /*
+     * flow->values is the rule's group for the key of this term, it is
+     * bound by filter_register_user_cb() and is NULL if the rule has no
+     * such group. The value comes already hashed, and with an index
+     * already matched against the group, see filter_request_fetch().
+     */
     if (!rule->strings)
         return 1;
 
-    if (!key || !val) {
+    if (!flow->values || !str) {
         return 0;
     }
 
-    if (!(string_hash = apr_hash_get
-          (rule->strings, (char *) key, APR_HASH_KEY_STRING)))
-        return 0;
+    if (str->hits)
+        return FILTER_INDEX_TEST(str->hits, rule->id) != 0;
 
+    key = &str->key;
 
-    if (apr_hash_get(string_hash, (char *) val, APR_HASH_KEY_STRING))
+    if (flow->set && strset_get(flow->set, key))
         return 1;
 
     /*
      * if we got to here and regex strings are found,
-     * loop through each one and determine if one matches
+     * loop through each one and determine if one matches.
+     * Fixed strings are looked for first, they go just like regexes
+     * would.
      */
     if (rule->strings_have_regex) {
-        /*
-         * first grab the array of regex that we would like to match
-         * against 
-         */
-        apr_array_header_t *regex_array;
-        int             i;
+        if (flow->fixed && filter_match_string_fixed(flow, key))
+            return 1;
 
-        regex_array = (apr_array_header_t *)
-            apr_hash_get(string_hash, REGEX_KEY, APR_HASH_KEY_STRING);
-
-        if (!regex_array)
+        if (!flow->regexes)
             /*
-             * this is an odd condition, we should never actually get here 
+             * this group has no regexes of its own 
              */
             return 0;
 
-        for (i = 0; i < regex_array->nelts; i++) {
-            regex_t        *tomatch = ((regex_t **) regex_array->elts)[i];
-
-            if (regexec(tomatch, val, 0, NULL, 0) == 0)
-                return 1;
-
-        }
+        return filter_match_string_regex(pool, flow, key->str);
     }
 
     return 0;
@@ -279,9 +409,10 @@ filter_match_string(apr_pool_t * pool,
 
 static int
 filter_match_not_string(apr_pool_t * pool,
-                        filter_rule_t * rule, void *val, void *key)
+                        filter_rule_t * rule, void *data, rule_flow_t * flow)
 {
-    apr_hash_t     *string_hash;
+    filter_string_t *str = data;
+    strset_key_t   *key;
 
     if (!rule->strings)
         /*
@@ -292,196 +423,344 @@ filter_match_not_string(apr_pool_t * pool,
         return 1;
     }
 
-    if (!key || !val) {
-        PRINT_DEBUG("No key/val %p %p\n", key, val);
+    if (!flow->values || !str) {
+        /*
+         * the group for the key was not found (or there is no value to
+         * compare), this means the thing doesn't even exist in our rule,
+         * so return a non-match 
+         */
+        PRINT_DEBUG("No group/val %p %p\n", flow->values, str);
         return 0;
     }
 
-    string_hash = apr_hash_get(rule->strings, (char *) key,
-                               APR_HASH_KEY_STRING);
+    if (str->hits) {
+        if (FILTER_INDEX_TEST(str->hits, rule->id))
+            return 0;
 
-    if (!string_hash)
         /*
-         * the hash for the key was not found, this means
-         * the thing doesn't even exist in our rule, so return a 
-         * non-match 
+         * as below, a group with neither fixed strings nor regexes in a
+         * rule with some elsewhere does not match either way
          */
-    {
-        PRINT_DEBUG("%s was not found as a likely candidate in the hash\n",
-                    (char *) key);
-
-        return 0;
+        return !rule->strings_have_regex || flow->fixed || flow->regexes;
     }
 
-    if (apr_hash_get(string_hash, (char *) val, APR_HASH_KEY_STRING))
+    key = &str->key;
+
+    if (flow->set && strset_get(flow->set, key))
         /*
          * this value was found within our hash, so in this case
          * we want to return a non match 
          */
     {
-        PRINT_DEBUG("%s was found\n", (char *) val);
+        PRINT_DEBUG("%s was found\n", key->str);
         return 0;
     }
 
     if (rule->strings_have_regex) {
-        apr_array_header_t *regex_array;
-        int             i;
-
-        regex_array = (apr_array_header_t *)
-            apr_hash_get(string_hash, REGEX_KEY, APR_HASH_KEY_STRING);
-
-        if (!regex_array)
+        if (!flow->fixed && !flow->regexes)
             return 0;
 
-        for (i = 0; i < regex_array->nelts; i++) {
-            /*
-             * if any of these matched, return a non found. 
-             */
-            regex_t        *tomatch = ((regex_t **) regex_array->elts)[i];
+        if (flow->fixed && filter_match_string_fixed(flow, key)) {
+            PRINT_DEBUG("%s matched a fixed string\n", key->str);
+            return 0;
+        }
 
-            PRINT_DEBUG("Comparing value %s to %p\n", (char *) val,
-                        tomatch);
+        if (!flow->regexes)
+            return 1;
 
-            if (regexec(tomatch, val, 0, NULL, 0) == 0)
-                return 0;
-        }
+        /*
+         * if any of these matched, return a non found. 
+         */
+        return !filter_match_string_regex(pool, flow, key->str);
     }
 
     return 1;
 }
 
-#define APPEND_FLOW(cflow, ctail, new) \
-    do { \
-        if(!cflow) cflow = ctail = new; \
-        else { \
-            new->this_operator = ctail->next_operator; \
-            ctail->next = new; \
-            ctail = new; \
-        } \
-    } while(0);
+int
+filter_rule_flow_set(rule_flow_t * flow, int type, char *user_data,
+                     int on_true, int on_false)
+{
+    flow->type = type;
+    flow->user_data = NULL;
+    flow->on_true = on_true;
+    flow->on_false = on_false;
+
+    switch (type) {
+    case RULE_MATCH_SRCADDR:
+        flow->callback = filter_match_srcaddr;
+        break;
+    case RULE_MATCH_DSTADDR:
+        flow->callback = filter_match_dstaddr;
+        break;
+    case RULE_MATCH_STRING:
+        if (!user_data)
+            return -1;
+        flow->callback = filter_match_string;
+        flow->user_data = user_data;
+        break;
+    case RULE_MATCH_NOT_SRCADDR:
+        flow->callback = filter_match_not_srcaddr;
+        break;
+    case RULE_MATCH_NOT_DSTADDR:
+        flow->callback = filter_match_not_dstaddr;
+        break;
+    case RULE_MATCH_NOT_STRING:
+        if (!user_data)
+            return -1;
+        flow->callback = filter_match_not_string;
+        flow->user_data = user_data;
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
 
-static rule_flow_t *
-filter_flow_from_str(apr_pool_t * pool, char *flowstr)
+/*
+ * A flow string is parsed into a small expression tree with the usual
+ * precedence ('!' binds tightest, then '&&', then '||') and parentheses,
+ * which is then compiled into a flat program of terms. Every term carries
+ * where to continue when it matches and when it doesn't, so a failing
+ * term of an AND jumps straight to the next alternative.
+ *
+ *   flow    := and ( '||' and )*
+ *   and     := unary ( '&&' unary )*
+ *   unary   := '!' unary | '(' flow ')' | term
+ *
+ * A '!' directly in front of a term is the term's own negated matcher
+ * (!match_src_addr and friends), in front of anything else it inverts
+ * the outcome.
+ */
+#define FLOW_NODE_NOT     -1
+#define FLOW_MAX_DEPTH    64
+
+typedef struct flow_node {
+    int                 type;
+    char               *key;
+    struct flow_node   *l;
+    struct flow_node   *r;
+    int                 nterms;
+} flow_node_t;
+
+typedef struct flow_parser {
+    apr_pool_t         *pool;
+    const char         *p;
+    int                 depth;
+} flow_parser_t;
+
+static flow_node_t *flow_parse_or(flow_parser_t *);
+
+static flow_node_t *
+flow_node_make(flow_parser_t * fp, int type, flow_node_t * l,
+               flow_node_t * r)
 {
-    char          **tokens;
-    char           *tok;
-    int             i = 0;
-    rule_flow_t    *tail = NULL;
-    rule_flow_t    *flow = NULL;
+    flow_node_t    *node;
+
+    node = apr_pcalloc(fp->pool, sizeof(flow_node_t));
+    node->type = type;
+    node->l = l;
+    node->r = r;
+    node->nterms = (l ? l->nterms : 1) + (r ? r->nterms : 0);
+
+    return node;
+}
 
-    PRINT_DEBUG("Starting the flow parser\n");
+static int
+flow_accept(flow_parser_t * fp, const char *tok)
+{
+    size_t          len = strlen(tok);
 
-    tokens = filter_tokenize_str(flowstr, " ", NULL);
+    while (isspace(*fp->p))
+        fp->p++;
 
-    PRINT_DEBUG("Token array at %p\n", tokens);
+    if (strncmp(fp->p, tok, len))
+        return 0;
 
-    while ((tok = tokens[i++]) != NULL) {
-        rule_flow_t    *new_flow;
+    fp->p += len;
+    return 1;
+}
 
-        PRINT_DEBUG("Setting up flow for token %s\n", tok);
+static flow_node_t *
+flow_parse_term(flow_parser_t * fp, int negate)
+{
+    flow_node_t    *node;
+    const char     *start;
+    char           *ident;
+    int             type;
 
-        switch (rule_token_to_int(tok)) {
-        case RULE_MATCH_SRCADDR:
-            PRINT_DEBUG("Found a RULE_MATCH_SRCADDR\n");
+    while (isspace(*fp->p))
+        fp->p++;
 
-            new_flow = filter_rule_flow_init(pool);
-            new_flow->callback = filter_match_srcaddr;
-            new_flow->type = RULE_MATCH_SRCADDR;
+    for (start = fp->p; isalnum(*fp->p) || *fp->p == '_'; fp->p++);
 
-            APPEND_FLOW(flow, tail, new_flow);
+    if (fp->p == start)
+        return NULL;
 
-            break;
-        case RULE_MATCH_DSTADDR:
-            PRINT_DEBUG("Found a RULE_MATCH_DSTADDR\n");
+    ident = apr_pstrndup(fp->pool, start, fp->p - start);
 
-            new_flow = filter_rule_flow_init(pool);
-            new_flow->callback = filter_match_dstaddr;
-            new_flow->type = RULE_MATCH_DSTADDR;
+    switch ((type = rule_token_to_int(ident))) {
+    case RULE_MATCH_SRCADDR:
+        type = negate ? RULE_MATCH_NOT_SRCADDR : type;
+        break;
+    case RULE_MATCH_DSTADDR:
+        type = negate ? RULE_MATCH_NOT_DSTADDR : type;
+        break;
+    case RULE_MATCH_STRING:
+        type = negate ? RULE_MATCH_NOT_STRING : type;
+        break;
+    default:
+        PRINT_DEBUG("Unknown flow term '%s'\n", ident);
+        return NULL;
+    }
 
-            APPEND_FLOW(flow, tail, new_flow);
+    node = flow_node_make(fp, type, NULL, NULL);
 
-            break;
-        case RULE_MATCH_STRING:
-            /*
-             * in order to have a proper string matching along with the
-             * proper precedence and ordering we must set a flow where the 
-             * value is the section of strings to match. 
-             */
+    if (type == RULE_MATCH_STRING || type == RULE_MATCH_NOT_STRING) {
+        /*
+         * match_string(key), the key runs up to the closing paren 
+         */
+        if (*fp->p != '(')
+            return NULL;
 
-            PRINT_DEBUG("Found a RULE_MATCH_STRING\n");
-            /*
-             * remove the match_string( and the ending ) 
-             */
-            tok[strlen(tok) - 1] = 0;
-            tok = &tok[13];
+        start = ++fp->p;
 
-            new_flow = filter_rule_flow_init(pool);
-            new_flow->callback = filter_match_string;
-            new_flow->type = RULE_MATCH_STRING;
-            new_flow->user_data = (void *) apr_pstrdup(pool, tok);
+        while (*fp->p && *fp->p != ')')
+            fp->p++;
 
-            APPEND_FLOW(flow, tail, new_flow);
+        if (*fp->p != ')')
+            return NULL;
 
-            break;
-        case RULE_MATCH_NOT_STRING:
-            PRINT_DEBUG("Found a RULE_MATCH_NOT_STRING\n");
-            tok[strlen(tok) - 1] = 0;
-            tok = &tok[14];
-
-            PRINT_DEBUG("Token is %s\n", tok);
-            new_flow = filter_rule_flow_init(pool);
-            new_flow->callback = filter_match_not_string;
-            new_flow->type = RULE_MATCH_NOT_STRING;
-            new_flow->user_data = (void *) apr_pstrdup(pool, tok);
-            APPEND_FLOW(flow, tail, new_flow);
-            break;
-        case RULE_MATCH_NOT_SRCADDR:
-            PRINT_DEBUG("Foudn a RULE_MATCH_NOT_SRCADDR\n");
-            new_flow = filter_rule_flow_init(pool);
-            new_flow->callback = filter_match_not_srcaddr;
-            new_flow->type = RULE_MATCH_NOT_SRCADDR;
+        node->key = apr_pstrndup(fp->pool, start, fp->p - start);
+        fp->p++;
+    }
 
-            APPEND_FLOW(flow, tail, new_flow);
-            break;
-        case RULE_MATCH_NOT_DSTADDR:
-            PRINT_DEBUG("Found a RULE_MATCH_NOT_DSTADDR\n");
-            new_flow = filter_rule_flow_init(pool);
-            new_flow->callback = filter_match_not_dstaddr;
-            new_flow->type = RULE_MATCH_NOT_DSTADDR;
+    return node;
+}
 
-            APPEND_FLOW(flow, tail, new_flow);
-            break;
-        case RULE_MATCH_OPERATOR_OR:
-            PRINT_DEBUG("Found a RULE_MATCH_OPERATOR_OR\n");
-            if (!flow)
-                /*
-                 * we can't have an operator with no starting flow! 
-                 */
-                return NULL;
-
-            PRINT_DEBUG("Setting the last flows next_operator to OR\n");
-            tail->next_operator = RULE_MATCH_OPERATOR_OR;
-            break;
-        case RULE_MATCH_OPERATOR_AND:
-            PRINT_DEBUG("Found a RULE_MATCH_OPERATOR_AND\n");
+static flow_node_t *
+flow_parse_unary(flow_parser_t * fp)
+{
+    flow_node_t    *node;
 
-            if (!flow)
-                return NULL;
+    if (++fp->depth > FLOW_MAX_DEPTH)
+        return NULL;
 
-            PRINT_DEBUG("Setting the last flows next_operator to AND\n");
-            tail->next_operator = RULE_MATCH_OPERATOR_AND;
-            break;
-        }
+    if (flow_accept(fp, "!")) {
+        if (isspace(*fp->p) || *fp->p == '(' || *fp->p == '!')
+            node = (node = flow_parse_unary(fp)) ?
+                flow_node_make(fp, FLOW_NODE_NOT, node, NULL) : NULL;
+        else
+            node = flow_parse_term(fp, 1);
+    } else if (flow_accept(fp, "(")) {
+        if ((node = flow_parse_or(fp)) && !flow_accept(fp, ")"))
+            node = NULL;
+    } else
+        node = flow_parse_term(fp, 0);
+
+    fp->depth--;
+    return node;
+}
+
+static flow_node_t *
+flow_parse_and(flow_parser_t * fp)
+{
+    flow_node_t    *node;
+    flow_node_t    *r;
+
+    if (!(node = flow_parse_unary(fp)))
+        return NULL;
+
+    while (flow_accept(fp, "&&")) {
+        if (!(r = flow_parse_unary(fp)))
+            return NULL;
+
+        node = flow_node_make(fp, RULE_MATCH_OPERATOR_AND, node, r);
+    }
+
+    return node;
+}
+
+static flow_node_t *
+flow_parse_or(flow_parser_t * fp)
+{
+    flow_node_t    *node;
+    flow_node_t    *r;
+
+    if (!(node = flow_parse_and(fp)))
+        return NULL;
+
+    while (flow_accept(fp, "||")) {
+        if (!(r = flow_parse_and(fp)))
+            return NULL;
+
+        node = flow_node_make(fp, RULE_MATCH_OPERATOR_OR, node, r);
     }
-    free_tokens(tokens);
-    return flow;
+
+    return node;
 }
 
 static int
-filter_rule_add_flow(filter_rule_t * rule, char *data)
+flow_emit(apr_pool_t * pool, rule_flow_t * program, int pc,
+          flow_node_t * node, int on_true, int on_false)
 {
-    rule->flow = filter_flow_from_str(rule->pool, data);
-    return 0;
+    /*
+     * terms are laid out left to right, so the right hand side of an
+     * operator starts right after the last term of its left hand side
+     * and every jump goes forward.
+     */
+    int             next;
+
+    switch (node->type) {
+    case RULE_MATCH_OPERATOR_AND:
+        next = pc + node->l->nterms;
+        flow_emit(pool, program, pc, node->l, next, on_false);
+        return flow_emit(pool, program, next, node->r, on_true, on_false);
+    case RULE_MATCH_OPERATOR_OR:
+        next = pc + node->l->nterms;
+        flow_emit(pool, program, pc, node->l, on_true, next);
+        return flow_emit(pool, program, next, node->r, on_true, on_false);
+    case FLOW_NODE_NOT:
+        return flow_emit(pool, program, pc, node->l, on_false, on_true);
+    default:
+        filter_rule_flow_set(&program[pc], node->type,
+                             node->key ? apr_pstrdup(pool, node->key) :
+                             NULL, on_true, on_false);
+        return pc + 1;
+    }
+}
+
+static int
+filter_rule_add_flow(filter_rule_t * rule, const char *data)
+{
+    flow_parser_t   fp;
+    flow_node_t    *root;
+    int             ret = 0;
+
+    if (!data)
+        return 0;
+
+    apr_pool_create(&fp.pool, rule->pool);
+    fp.p = data;
+    fp.depth = 0;
+
+    PRINT_DEBUG("Compiling flow '%s'\n", data);
+
+    if (!(root = flow_parse_or(&fp)) || !flow_accept(&fp, "") || *fp.p) {
+        PRINT_DEBUG("Flow syntax error at '%s'\n", fp.p);
+        rule->flow = NULL;
+        rule->flow_len = 0;
+        ret = -1;
+    } else {
+        rule->flow = filter_rule_flow_init(rule->pool, root->nterms);
+        rule->flow_len = root->nterms;
+        flow_emit(rule->pool, rule->flow, 0, root,
+                  FILTER_FLOW_ACCEPT, FILTER_FLOW_REJECT);
+    }
+
+    apr_pool_destroy(fp.pool);
+    return ret;
 }
 
 filter_t       *
@@ -490,12 +769,13 @@ filter_init(apr_pool_t * parent)
     filter_t       *ret;
     ret = apr_pcalloc(parent, sizeof(filter_t));
     apr_pool_create(&ret->pool, parent);
-
+    apr_pool_create(&ret->dynamic_pool, ret->pool);
+    ret->fact_count = FILTER_FACT_STRINGS;
 
     return ret;
 }
 
-static filter_rule_t *
+filter_rule_t  *
 filter_rule_init(apr_pool_t * parent)
 {
     filter_rule_t  *rule;
@@ -533,8 +813,27 @@ filter_get_rule(filter_t * filter, const char *rule_name)
     return ruleptr;
 }
 
+/*
+ * how many of the filter's regexes were found to be plain strings and are
+ * matched as such
+ */
+uint32_t
+filter_regexes_lowered(filter_t * filter)
+{
+    filter_rule_t  *rule;
+    uint32_t        lowered = 0;
 
-static int
+    for (rule = filter->head; rule; rule = rule->next)
+        lowered += rule->regexes_lowered;
+
+    if (filter->whitelist_rule)
+        lowered += filter->whitelist_rule->regexes_lowered;
+
+    return lowered;
+}
+
+
+int
 filter_add_rule(filter_t * filter, filter_rule_t * rule)
 {
     PRINT_DEBUG("inserting %p into filter %p\n", rule, filter);
@@ -542,6 +841,11 @@ filter_add_rule(filter_t * filter, filter_rule_t * rule)
     if (!filter || !rule)
         return -1;
 
+    /*
+     * a rule added after the index was built is not in it 
+     */
+    filter->index = NULL;
+
     if (!filter->tail) {
         filter->head = filter->tail = rule;
         filter->rule_count++;
@@ -661,222 +965,985 @@ filter_rule_add_network(filter_rule_t * rule,
     return 0;
 }
 
-static int
-filter_rule_add_string(filter_rule_t * rule, char *key, char *val,
-                       const int is_regex)
+int
+filter_rule_add_prefix(filter_rule_t * rule, const int direction,
+                       int family, const void *addr, int bitlen, void *data)
 {
     /*
-     * a string match set is a hash of hashes. The "key" in this case is
-     * a hash key of our rule->strings hash. The values of that hash will
-     * be our value passed to this function. 
-     */
-
-    /*
-     * ok, string matching rules are a bit odd here. I haven't really
-     * thought of a more dynamic way to do this that fits in with the
-     * current architecture. With string matching we can have multiple
-     * "keys" or string groups. In order to facilitate these groups
-     * within our rule we have a hash of hashes that can be found under
-     * rule->strings. For every "group" found within the config, the
-     * group name is used as a key to another hash which holds all of the
-     * values. Since our string matching is static strings we hash the
-     * string values with a value of 1 Now to how strings work with our
-     * rule flow. In normal situations we have a set of flow callbacks,
-     * these callbacks are run after running a user set callback that
-     * fetches the correct data for the flow in question. 
+     * same as filter_rule_add_network() for an address that is already in
+     * binary form, this is what a precompiled image is loaded with.
      */
-    apr_hash_t     *subnode;
-    char           *ckey;
-    char           *cval;
-
-    ckey = (char *) apr_pstrdup(rule->pool, key);
-    cval = (char *) apr_pstrdup(rule->pool, val);
-
-
-    if (!rule->strings)
-        rule->strings = apr_hash_make(rule->pool);
+    patricia_tree_t **tree;
+    patricia_node_t *pnode;
+    prefix_t       *prefix;
 
-    if (!(subnode = apr_hash_get(rule->strings,
-                                 (char *) ckey, APR_HASH_KEY_STRING))) {
+    switch (direction) {
+    case RULE_MATCH_SRCADDR:
+        tree = &rule->src_addrs;
+        break;
+    case RULE_MATCH_DSTADDR:
+        tree = &rule->dst_addrs;
+        break;
+    default:
+        return -1;
+    }
+
+    if (*tree == NULL)
+        *tree = New_Patricia(rule->pool, 128);
+
+    if (!(prefix = New_Prefix(rule->pool, family, (void *) addr, bitlen)))
+        return -1;
+
+    pnode = patricia_lookup(rule->pool, *tree, prefix);
+    Deref_Prefix(prefix);
+
+    if (!pnode)
+        return -1;
+
+    pnode->data = data;
+
+    return 0;
+}
+
+static filter_dynamic_t *
+filter_dynamic_init(apr_pool_t * parent)
+{
+    filter_dynamic_t *dynamic;
+
+    dynamic = apr_pcalloc(parent, sizeof(filter_dynamic_t));
+
+#ifdef APR_HAS_THREADS
+    if (apr_thread_rwlock_create(&dynamic->rwlock, parent) != APR_SUCCESS)
+        return NULL;
+#endif
+
+    apr_pool_create(&dynamic->pool, parent);
+    dynamic->src_addrs = New_Patricia(dynamic->pool, 128);
+
+    return dynamic;
+}
+
+int
+filter_rule_update_network(filter_rule_t * rule, const char *network)
+{
+    /*
+     * called from the request path when an update-rule matches, so unlike
+     * filter_rule_add_network() this may run concurrently with other
+     * threads evaluating the very same rule.
+     */
+    filter_dynamic_t *dynamic;
+    patricia_node_t *pnode;
+
+    if (!(dynamic = rule->dynamic) || !network)
+        return -1;
+
+#ifdef APR_HAS_THREADS
+    apr_thread_rwlock_wrlock(dynamic->rwlock);
+#endif
+
+    if ((pnode = make_and_lookup(dynamic->pool, dynamic->src_addrs,
+                                 (char *) network)))
+        pnode->data = FILTER_RULE_IP_ADD;
+
+#ifdef APR_HAS_THREADS
+    apr_thread_rwlock_unlock(dynamic->rwlock);
+#endif
+
+    return pnode ? 0 : -1;
+}
+
+/*
+ * give every update-rule's runtime state (its lock, pool and tree of
+ * addresses) fresh storage from pool, dropping whatever was added so far.
+ * A process serving requests from a filter some other process built calls
+ * this first, so that update-rules neither allocate from the builder's
+ * allocator, which has no lock, nor write to the pages they share.
+ */
+int
+filter_dynamic_attach(filter_t * filter, apr_pool_t * pool)
+{
+    filter_rule_t  *rule;
+
+    for (rule = filter->head; rule; rule = rule->next) {
+        filter_dynamic_t *dynamic = rule->dynamic;
+
+        if (!dynamic)
+            continue;
+
+#ifdef APR_HAS_THREADS
+        if (apr_thread_rwlock_create(&dynamic->rwlock, pool) != APR_SUCCESS)
+            return -1;
+#endif
+
+        if (apr_pool_create(&dynamic->pool, pool) != APR_SUCCESS)
+            return -1;
+
+        dynamic->src_addrs = New_Patricia(dynamic->pool, 128);
+    }
+
+    return 0;
+}
+
+/*
+ * give every regset of the filter, the rules' and the index's, a cache
+ * of its own allocated from pool, the way filter_dynamic_attach() does
+ * for update-rules: matching against a regset writes to its cache.
+ */
+int
+filter_regset_attach(filter_t * filter, apr_pool_t * pool)
+{
+    apr_hash_index_t *hi;
+    void           *val;
+
+    if (filter->regsets)
+        for (hi = apr_hash_first(NULL, filter->regsets); hi;
+             hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, NULL, NULL, &val);
+
+            if (regset_attach(val, pool) == -1)
+                return -1;
+        }
+
+    if (filter->index)
+        for (hi = apr_hash_first(NULL, filter->index->keys); hi;
+             hi = apr_hash_next(hi)) {
+            filter_index_key_t *key;
+
+            apr_hash_this(hi, NULL, NULL, &val);
+            key = val;
+
+            if (key->regexes && regset_attach(key->regexes, pool) == -1)
+                return -1;
+        }
+
+    return 0;
+}
+
+int
+filter_rule_set_update_rule(filter_t * filter, filter_rule_t * rule,
+                            filter_rule_t * ud_rule)
+{
+    rule->update_rule = ud_rule;
+
+    if (!ud_rule->dynamic &&
+        !(ud_rule->dynamic = filter_dynamic_init(filter->dynamic_pool)))
+        return -1;
+
+    return 0;
+}
+
+static int
+filter_rule_add_string(filter_rule_t * rule, char *key, char *val,
+                       const int type)
+{
+    /*
+     * a string match set is a hash of hashes. The "key" in this case is
+     * a hash key of our rule->strings hash. The values of that hash will
+     * be our value passed to this function. 
+     */
+
+    /*
+     * ok, string matching rules are a bit odd here. I haven't really
+     * thought of a more dynamic way to do this that fits in with the
+     * current architecture. With string matching we can have multiple
+     * "keys" or string groups. In order to facilitate these groups
+     * within our rule we have a hash of hashes that can be found under
+     * rule->strings. For every "group" found within the config, the
+     * group name is used as a key to another hash which holds all of the
+     * values. Since our string matching is static strings we hash the
+     * string values with a value of 1 Now to how strings work with our
+     * rule flow. In normal situations we have a set of flow callbacks,
+     * these callbacks are run after running a user set callback that
+     * fetches the correct data for the flow in question. 
+     */
+    return filter_rule_insert_string(rule,
+                                     (char *) apr_pstrdup(rule->pool, key),
+                                     (char *) apr_pstrdup(rule->pool, val),
+                                     type);
+}
+
+/*
+ * a regex which is nothing but a literal, maybe anchored at either end or
+ * padded with ".*", is matched as the fixed string it amounts to:
+ * "^tester$" is the value "tester", "^/login" a prefix, "\.php$" a
+ * suffix and "evil" or ".*evil.*" a substring. Returns the FILTER_STRING_
+ * type the pattern comes down to, with the literal in *literal, or
+ * FILTER_STRING_REGEX if it has to stay a regex.
+ */
+static int
+filter_regex_lower(apr_pool_t * pool, const char *pattern, char **literal)
+{
+    const char     *p = pattern;
+    char           *out;
+    size_t          len = 0;
+    int             head = 0,
+                    tail = 0;
+
+    out = apr_palloc(pool, strlen(pattern) + 1);
+
+    if (*p == '^') {
+        head = 1;
+        p++;
+    }
+
+    for (; p[0] == '.' && p[1] == '*'; p += 2)
+        head = 0;
+
+    for (; *p; p++) {
+        unsigned char   c = *p;
+
+        if (c == '$' && !p[1]) {
+            tail = 1;
+            break;
+        }
+
+        if (c == '.' && p[1] == '*') {
+            /*
+             * only ".*" (and an end anchor it makes moot) may follow
+             */
+            for (; p[0] == '.' && p[1] == '*'; p += 2);
+
+            if (*p == '$')
+                p++;
+
+            if (*p)
+                return FILTER_STRING_REGEX;
+
+            break;
+        }
+
+        if (c == '\\') {
+            /*
+             * only an escaped metacharacter is the character itself, \<,
+             * \', \w and the like are anchors and classes to regcomp()
+             */
+            c = p[1];
+
+            if (!c || !strchr(".[]()*+?{}|^$\\/", c))
+                return FILTER_STRING_REGEX;
+
+            p++;
+        } else if (c >= 0x80 || strchr(".[]()*+?{}|^$", c))
+            return FILTER_STRING_REGEX;
+
+        /*
+         * a quantified character is not a literal one 
+         */
+        if (p[1] && strchr("*+?{", p[1]))
+            return FILTER_STRING_REGEX;
+
+        out[len++] = c;
+    }
+
+    out[len] = '\0';
+    *literal = out;
+
+    if (head && tail)
+        return FILTER_STRING_VALUE;
+
+    if (head)
+        return FILTER_STRING_PREFIX;
+
+    if (tail)
+        return FILTER_STRING_SUFFIX;
+
+    return FILTER_STRING_CONTAINS;
+}
+
+/*
+ * substrings, prefixes and suffixes are kept in an array under FIXED_KEY,
+ * much like the regexes, and compiled into a single matcher when a term
+ * on the group is bound. regex is the pattern the string was lowered
+ * from, if it was.
+ */
+static void
+filter_group_add_fixed(filter_rule_t * rule, apr_hash_t * subnode,
+                       const char *string, int type, const char *regex)
+{
+    apr_array_header_t *fixed;
+    filter_fixed_t *f;
+
+    if (!(fixed = apr_hash_get(subnode, FIXED_KEY, APR_HASH_KEY_STRING))) {
+        fixed = apr_array_make(rule->pool, 1, sizeof(filter_fixed_t));
+        apr_hash_set(subnode, FIXED_KEY, APR_HASH_KEY_STRING, fixed);
+    }
+
+    f = (filter_fixed_t *) apr_array_push(fixed);
+    f->string = string;
+    f->type = type;
+    f->regex = regex;
+
+    /*
+     * as far as the rule's other groups are concerned a fixed string is
+     * just another regex
+     */
+    rule->strings_have_regex = 1;
+}
+
+int
+filter_rule_insert_string(filter_rule_t * rule, char *ckey, char *cval,
+                          const int type)
+{
+    /*
+     * same as filter_rule_add_string() but the key and value are used as
+     * is, they must live at least as long as the rule does. A NULL value
+     * only creates the (empty) group.
+     */
+    apr_hash_t     *subnode;
+
+    if (!rule->strings)
+        rule->strings = apr_hash_make(rule->pool);
+
+    if (!(subnode = apr_hash_get(rule->strings,
+                                 (char *) ckey, APR_HASH_KEY_STRING))) {
         subnode = apr_hash_make(rule->pool);
         apr_hash_set(rule->strings, ckey, APR_HASH_KEY_STRING, subnode);
 
     }
 
-    if (!is_regex) {
-        apr_hash_set(subnode, cval, APR_HASH_KEY_STRING, (void *) 1);
-    } else {
-        /*
-         * if a _R_E_G_E_X_ key is not set within our hash we create it
-         * using the above string as the key. The value of the key will
-         * be an apr_array_header_t (apr array). This array will
-         * contain a set of regex values that the input string can be
-         * compared against. 
-         */
-        apr_array_header_t *regex_array;
-        regex_t        *pattern;
-        int             regcomp_ret;
+    if (type == FILTER_STRING_VALUE) {
+        /*
+         * a value a regex was lowered to keeps its pattern, see below 
+         */
+        if (cval && !apr_hash_get(subnode, cval, APR_HASH_KEY_STRING))
+            apr_hash_set(subnode, cval, APR_HASH_KEY_STRING, (void *) 1);
+    } else if (type != FILTER_STRING_REGEX) {
+        if (cval)
+            filter_group_add_fixed(rule, subnode, cval, type, NULL);
+    } else {
+        /*
+         * if a _R_E_G_E_X_ key is not set within our hash we create it
+         * using the above string as the key. The value of the key will
+         * be an apr_array_header_t (apr array). This array will
+         * contain a set of regex values that the input string can be
+         * compared against. 
+         */
+        apr_array_header_t *regex_array;
+        filter_regex_t *pattern;
+        char           *literal;
+        int             regcomp_ret,
+                        lowered;
+
+        if (!(regex_array = apr_hash_get(subnode, REGEX_KEY,
+                                         APR_HASH_KEY_STRING))) {
+            /*
+             * initialize our array to a size of 1 
+             */
+            regex_array = apr_array_make(rule->pool, 1,
+                                         sizeof(filter_regex_t *));
+
+            /*
+             * insert our array into the subnode hash 
+             */
+            apr_hash_set(subnode, REGEX_KEY,
+                         APR_HASH_KEY_STRING, regex_array);
+        }
+
+        if (!cval)
+            return 0;
+
+        /*
+         * a regex that is really a fixed string is stored as one, the
+         * group keeps its (maybe empty) array of regexes so that it
+         * matches just as it would have. The pattern is kept next to
+         * the string for the image writer.
+         */
+        switch (lowered = filter_regex_lower(rule->pool, cval, &literal)) {
+        case FILTER_STRING_REGEX:
+            break;
+        case FILTER_STRING_VALUE:
+            apr_hash_set(subnode, literal, APR_HASH_KEY_STRING, cval);
+            rule->strings_have_regex = 1;
+            rule->regexes_lowered++;
+            return 0;
+        default:
+            filter_group_add_fixed(rule, subnode, literal, lowered, cval);
+            rule->regexes_lowered++;
+            return 0;
+        }
+
+        pattern = apr_palloc(rule->pool, sizeof(filter_regex_t));
+        pattern->pattern = cval;
+        regcomp_ret = regcomp(&pattern->regex, cval, REG_EXTENDED);
+
+        if (regcomp_ret != 0)
+            return -1;
+
+        pattern->literal = regset_literal(rule->pool, cval);
+
+        /*
+         * since the regcomp will allocate other things within the regex_t 
+         * structure, we need to tell our pool cleanup mechanism to call
+         * regfree() before killing the pool 
+         */
+        apr_pool_cleanup_register(rule->pool, &pattern->regex,
+                                  (void *) regfree, apr_pool_cleanup_null);
+
+        *(filter_regex_t **) apr_array_push(regex_array) = pattern;
+
+        /*
+         * notify our string matcher that there are regex matches to
+         * process 
+         */
+        rule->strings_have_regex = 1;
+    }
+
+    PRINT_DEBUG("Inserted string match: %s:%10s (type %d)\n",
+                ckey, cval, type);
+    return 0;
+
+}
+
+filter_request_t *
+filter_request_init(apr_pool_t * pool, filter_t * filter,
+                    const void *usrdata)
+{
+    filter_request_t *req;
+
+    req = apr_pcalloc(pool, sizeof(filter_request_t));
+    req->filter = filter;
+    req->pool = pool;
+    req->usrdata = usrdata;
+    apr_pool_create(&req->scratch, pool);
+    req->facts = apr_pcalloc(pool, sizeof(void *) * filter->fact_count);
+    req->fetched = apr_pcalloc(pool, filter->fact_count);
+    req->terms = apr_pcalloc(pool, filter->term_count + 1);
+    req->strings = apr_pcalloc(pool,
+                               sizeof(filter_string_t) * filter->fact_count);
+
+    if ((req->index = filter->index)) {
+        apr_size_t      size;
+        int             i;
+
+        size = FILTER_INDEX_WORDS(req->index->nrules) * 4;
+
+        for (i = 0; i < FILTER_FACT_STRINGS; i++) {
+            req->addrs[i].add = apr_palloc(pool, size);
+            req->addrs[i].sub = apr_palloc(pool, size);
+        }
+
+        req->candidates = apr_palloc(pool, size);
+
+        if (filter->bitset_eval) {
+            req->results = apr_palloc(pool, size);
+            req->reach = apr_palloc(pool, size * (req->index->max_len + 1));
+        }
+    }
+
+    return req;
+}
+
+void
+filter_request_set_usrdata(filter_request_t * req, const void *usrdata)
+{
+    /*
+     * facts fetched with the old data are no good anymore 
+     */
+    req->usrdata = usrdata;
+    memset(req->fetched, 0, req->filter->fact_count);
+    memset(req->terms, 0, req->filter->term_count + 1);
+    req->have_candidates = 0;
+    req->have_results = 0;
+}
+
+void
+filter_request_forget(filter_request_t * req, int fact)
+{
+    /*
+     * the application changed what the callback for this fact will
+     * return, fetch it again the next time it is needed. 
+     */
+    if (fact >= 0 && fact < req->filter->fact_count) {
+        req->fetched[fact] = 0;
+
+        if (fact >= FILTER_FACT_STRINGS)
+            memset(req->terms, 0, req->filter->term_count + 1);
+
+        req->have_candidates = 0;
+        req->have_results = 0;
+    }
+}
+
+int
+filter_fact_id(filter_t * filter, const char *key)
+{
+    int            *id;
+
+    if (!filter->fact_ids ||
+        !(id = apr_hash_get(filter->fact_ids, key, APR_HASH_KEY_STRING)))
+        return -1;
+
+    return *id;
+}
+
+/*
+ * fetch a fact from the calling application, unless it already was for
+ * this request. It is fetched from the request's pool, the one the terms
+ * are matched with is cleared after every rule. Addresses are parsed
+ * right away and strings hashed and run through the index once for all
+ * rules, the terms only ever see the result.
+ */
+static void    *
+filter_request_fetch(filter_request_t * req, int fact,
+                     void *(*fetch) (apr_pool_t *, void *, const void *),
+                     void *fc_data)
+{
+    void           *data;
+
+    if (req->fetched[fact])
+        return req->facts[fact];
+
+    data = fetch(req->pool, fc_data, req->usrdata);
+
+    if (fact < FILTER_FACT_STRINGS) {
+        filter_addr_t  *addr = &req->addrs[fact];
+
+        addr->family = ascii2addr(0, data, addr->addr, &addr->bitlen);
+        data = addr->family ? addr : NULL;
+
+        if (data && req->index)
+            filter_index_lookup(req->index, fact, addr);
+    } else if (data) {
+        filter_string_t *str = &req->strings[fact];
+
+        strset_key(&str->key, data);
+
+        if (req->index) {
+            if (!str->hits)
+                str->hits = apr_palloc(req->pool,
+                                       FILTER_INDEX_WORDS(req->index->
+                                                          nrules) * 4);
+
+            filter_index_match(req->index, fact, str, req->scratch);
+        }
+
+        data = str;
+    }
+
+    req->facts[fact] = data;
+    req->fetched[fact] = 1;
+
+    return data;
+}
+
+static int
+filter_match_flow(apr_pool_t * pool, filter_request_t * req,
+                  filter_rule_t * rule, rule_flow_t * flow)
+{
+    /*
+     * If a callback isn't registered for the data a term needs, the term
+     * does not match.
+     */
+    void           *data;
+    int             matched;
+
+    if (!flow->fetch) {
+        PRINT_DEBUG("No callback defined for flow type %d\n", flow->type);
+        return 0;
+    }
+
+    /*
+     * a string term says the same for every address of the request, it
+     * is only matched the first time around
+     */
+    if (flow->term && req->terms[flow->term])
+        return req->terms[flow->term] - 1;
+
+    data = filter_request_fetch(req, flow->fact, flow->fetch,
+                                flow->user_data);
+
+    matched = flow->callback(pool, rule, data, flow) == 1;
+
+    if (flow->term)
+        req->terms[flow->term] = matched + 1;
+
+    return matched;
+}
+
+static void
+filter_request_anchor_addr(filter_request_t * req, int fact,
+                           void *(*fetch) (apr_pool_t *, void *,
+                                           const void *),
+                           uint32_t * anchored)
+{
+    filter_addr_t  *addr;
+    uint32_t        w;
+
+    /*
+     * without the callback the address terms never match 
+     */
+    if (!fetch || !(addr = filter_request_fetch(req, fact, fetch, NULL)))
+        return;
+
+    for (w = 0; w < FILTER_INDEX_WORDS(req->index->nrules); w++)
+        req->candidates[w] |= anchored[w] & addr->add[w];
+}
+
+/*
+ * work out which rules can match this request from the facts their
+ * anchors are on, see filter_index.h.
+ */
+static void
+filter_request_candidates(filter_request_t * req)
+{
+    filter_index_t *index = req->index;
+    filter_callbacks_t *callbacks = &req->filter->callbacks;
+    uint32_t        w;
+    int             i;
+
+    memcpy(req->candidates, index->always,
+           FILTER_INDEX_WORDS(index->nrules) * 4);
+
+    for (i = 0; i < index->anchors->nelts; i++) {
+        filter_index_anchor_t *anchor;
+        filter_string_t *value;
+
+        anchor = ((filter_index_anchor_t **) index->anchors->elts)[i];
+
+        if (!anchor->flow->fetch)
+            continue;
+
+        value = filter_request_fetch(req, anchor->flow->fact,
+                                     anchor->flow->fetch,
+                                     anchor->flow->user_data);
+
+        if (!value)
+            continue;
+
+        for (w = 0; w < FILTER_INDEX_WORDS(index->nrules); w++)
+            req->candidates[w] |= anchor->anchored[w] & value->hits[w];
+    }
+
+    if (index->src_anchors)
+        filter_request_anchor_addr(req, FILTER_FACT_SRCADDR,
+                                   callbacks->src_addr_cb,
+                                   index->src_anchored);
+
+    if (index->dst_anchors)
+        filter_request_anchor_addr(req, FILTER_FACT_DSTADDR,
+                                   callbacks->dst_addr_cb,
+                                   index->dst_anchored);
+
+    req->have_candidates = 1;
+}
+
+/*
+ * what a kind of term (see filter_index.h) says for all the rules of the
+ * words [lo, hi), into t. A term without its callback never matches,
+ * otherwise:
+ *
+ *   match_src_addrs / match_dst_addrs: the rules without such addresses
+ *     (always), or the ones the index says hold the address as a '+'.
+ *   !match_src_addrs / !match_dst_addrs: the rules not holding it as a
+ *     '+'.
+ *   match_string: the rules without strings (always), or the ones whose
+ *     group the value hits.
+ *   !match_string: the rules without strings (always), or the ones
+ *     with a group that can match this way (cond) which the value does
+ *     not hit.
+ */
+static void
+filter_request_kind(filter_request_t * req, filter_index_kind_t * kind,
+                    uint32_t lo, uint32_t hi, uint32_t * t)
+{
+    rule_flow_t    *flow = kind->flow;
+    uint32_t       *bits = NULL;
+    void           *data;
+    uint32_t        w;
+
+    if (!flow->fetch)
+        return;
+
+    data = filter_request_fetch(req, flow->fact, flow->fetch,
+                                flow->user_data);
+
+    if (data)
+        bits = flow->fact < FILTER_FACT_STRINGS ?
+            ((filter_addr_t *) data)->add : ((filter_string_t *) data)->hits;
+
+    switch (flow->type) {
+    case RULE_MATCH_SRCADDR:
+    case RULE_MATCH_DSTADDR:
+    case RULE_MATCH_STRING:
+        for (w = lo; w < hi; w++)
+            t[w - lo] |= kind->rules[w] &
+                (kind->always[w] | (bits ? bits[w] : 0));
+        break;
+    case RULE_MATCH_NOT_SRCADDR:
+    case RULE_MATCH_NOT_DSTADDR:
+        for (w = lo; w < hi; w++)
+            t[w - lo] |= kind->rules[w] & ~(bits ? bits[w] : 0);
+        break;
+    case RULE_MATCH_NOT_STRING:
+        for (w = lo; w < hi; w++)
+            t[w - lo] |= kind->rules[w] &
+                (kind->always[w] | (bits ? kind->cond[w] & ~bits[w] : 0));
+        break;
+    }
+}
+
+/*
+ * match every rule at once. The rules of a shape start out at its first
+ * term and are routed term by term along the true or false jump by their
+ * bit of the term's result, jumps only going forward; the ones routed to
+ * FILTER_FLOW_ACCEPT match. A term no rule gets to is not looked at, nor
+ * are the facts only it needs fetched. Rules the index can not answer
+ * for are left set in the results, to be matched on their own.
+ */
+static void
+filter_request_evaluate(filter_request_t * req)
+{
+    filter_index_t *index = req->index;
+    uint32_t       *t = req->reach;
+    int             i;
 
-        if (!(regex_array = apr_hash_get(subnode, REGEX_KEY,
-                                         APR_HASH_KEY_STRING))) {
-            /*
-             * initialize our array to a size of 1 
-             */
-            regex_array = apr_array_make(rule->pool, 1, sizeof(regex_t *));
+    memcpy(req->results, index->slow, FILTER_INDEX_WORDS(index->nrules) * 4);
 
-            /*
-             * insert our array into the subnode hash 
-             */
-            apr_hash_set(subnode, REGEX_KEY,
-                         APR_HASH_KEY_STRING, regex_array);
-        }
+    for (i = 0; i < index->shapes->nelts; i++) {
+        filter_index_shape_t *shape;
+        uint32_t        words,
+                        w;
+        uint32_t       *reach;
+        int             pc,
+                        k;
 
-        pattern = apr_palloc(rule->pool, sizeof(regex_t));
-        regcomp_ret = regcomp(pattern, cval, REG_EXTENDED);
+        shape = ((filter_index_shape_t **) index->shapes->elts)[i];
+        words = shape->hi - shape->lo;
+        reach = req->reach + words;
 
-        if (regcomp_ret != 0)
-            return -1;
+        memset(reach, 0, words * 4 * shape->len);
+        memcpy(reach, shape->rules + shape->lo, words * 4);
 
-        /*
-         * since the regcomp will allocate other things within the regex_t 
-         * structure, we need to tell our pool cleanup mechanism to call
-         * regfree() before killing the pool 
-         */
-        apr_pool_cleanup_register(rule->pool, pattern, (void *) regfree,
-                                  apr_pool_cleanup_null);
+        for (pc = 0; pc < shape->len; pc++) {
+            uint32_t       *here = &reach[pc * words];
+            uint32_t       *on_true = NULL,
+                           *on_false = NULL;
+            uint32_t        any = 0;
+            rule_flow_t    *flow = &shape->flow[pc];
 
-        *(regex_t **) apr_array_push(regex_array) = pattern;
+            for (w = 0; w < words; w++)
+                any |= here[w];
 
-        /*
-         * notify our string matcher that there are regex matches to
-         * process 
-         */
-        rule->strings_have_regex = 1;
+            if (!any)
+                continue;
+
+            memset(t, 0, words * 4);
+
+            for (k = 0; k < shape->kinds[pc]->nelts; k++)
+                filter_request_kind(req, &((filter_index_kind_t *)
+                                           shape->kinds[pc]->elts)[k],
+                                    shape->lo, shape->hi, t);
+
+            if (flow->on_true >= 0)
+                on_true = &reach[flow->on_true * words];
+            else if (flow->on_true == FILTER_FLOW_ACCEPT)
+                on_true = &req->results[shape->lo];
+
+            if (flow->on_false >= 0)
+                on_false = &reach[flow->on_false * words];
+            else if (flow->on_false == FILTER_FLOW_ACCEPT)
+                on_false = &req->results[shape->lo];
+
+            for (w = 0; on_true && w < words; w++)
+                on_true[w] |= here[w] & t[w];
+
+            for (w = 0; on_false && w < words; w++)
+                on_false[w] |= here[w] & ~t[w];
+        }
     }
 
-    PRINT_DEBUG("Inserted string match: %s:%10s (regex?%s)\n",
-                ckey, cval, is_regex ? "yes" : "no");
-    return 0;
+    req->have_results = 1;
+}
+
+/*
+ * the first candidate with an id in [id, end), end if there is none
+ */
+static uint32_t
+filter_next_candidate(const uint32_t * candidates, uint32_t id, uint32_t end)
+{
+    while (id < end) {
+        uint32_t        word = candidates[id >> 5] >> (id & 31);
+
+        if (word) {
+            id += __builtin_ctz(word);
+            return id < end ? id : end;
+        }
 
+        id = (id | 31) + 1;
+    }
+
+    return end;
 }
 
 static int
-filter_match_rulen(apr_pool_t * pool, filter_t * filter,
-                   filter_rule_t * rule, const void *usrdata)
+filter_match_rulen(apr_pool_t * pool, filter_request_t * req,
+                   filter_rule_t * rule)
 {
-    int             matched_rule = 0;
-    rule_flow_t    *flows = rule->flow;
+    int             pc = 0;
 
     PRINT_DEBUG("Checking out rule %s\n", rule->name);
 
-    while (flows != NULL) {
-        void           *data,
-                       *extra;
-        extra = NULL;
+    if (!rule->flow)
+        return 0;
 
-        switch (flows->type) {
-        case RULE_MATCH_NOT_SRCADDR:
-        case RULE_MATCH_SRCADDR:
-            PRINT_DEBUG("Processing flow SRCADDD\n");
-            if (!filter->callbacks.src_addr_cb) {
-                PRINT_DEBUG("No SRCADDR Callback defined\n");
-                flows = flows->next;
-                continue;
-            }
-	    /* fetch the source address from the calling application */
-            data = filter->callbacks.src_addr_cb(pool, NULL, usrdata);
-            break;
-        case RULE_MATCH_NOT_DSTADDR:
-        case RULE_MATCH_DSTADDR:
-            PRINT_DEBUG("Processing flow DSTADDR\n");
-            if (!filter->callbacks.dst_addr_cb) {
-                PRINT_DEBUG("No DSTADDR callback defined\n");
-                flows = flows->next;
-                continue;
-            }
-	    /* fetch the destination address from the calling application */
-            data = filter->callbacks.dst_addr_cb(pool, NULL, usrdata);
-            break;
-        case RULE_MATCH_NOT_STRING:
-        case RULE_MATCH_STRING:
-            /*
-             * first we must find the callback associated with this
-             * string key 
-             */
-            {
-                void           *(*cb) (apr_pool_t * pool, void *fc_data,
-                                       const void *usrdata);
-
-                if (!filter->callbacks.string_callbacks ||
-                    !(cb = apr_hash_get(filter->callbacks.string_callbacks,
-                                        flows->user_data,
-                                        APR_HASH_KEY_STRING))) {
-                    PRINT_DEBUG("No string callback defined\n");
-                    flows = flows->next;
-                    continue;
-                }
-                data = cb(pool, flows->user_data, usrdata);
-                PRINT_DEBUG("Processed flow STRING %s data %s\n", flows->user_data, data);
-                extra = flows->user_data;
-            }
-            break;
-        }
+    while (pc >= 0) {
+        rule_flow_t    *flow = &rule->flow[pc];
 
-        if (flows->callback(pool, rule, data, extra) == 1) {
-            /*
-             * We matched something in this callback. 
-             */
+        if (filter_match_flow(pool, req, rule, flow)) {
             PRINT_DEBUG("Flow matched!\n");
-            if (flows->next_operator == RULE_MATCH_OPERATOR_OR) {
-                PRINT_DEBUG
-                    ("Next operator is an OR, flow processing complete\n");
-                matched_rule = 1;
-                break;
-            }
+            pc = flow->on_true;
+        } else {
+            PRINT_DEBUG("FLOW did NOT match!\n");
+            pc = flow->on_false;
+        }
+    }
+
+    return pc == FILTER_FLOW_ACCEPT;
+}
+
+/*
+ * whether the rule with this id, which the index let through, matches.
+ * With bitset_eval it does unless it has to be matched on its own.
+ */
+static int
+filter_request_match_id(filter_request_t * req, apr_pool_t * scratch,
+                        uint32_t id)
+{
+    if (req->results && !FILTER_INDEX_TEST(req->index->slow, id))
+        return 1;
+
+    return filter_match_rulen(scratch, req, req->index->rules[id]) == 1;
+}
+
+filter_rule_t  *
+filter_request_traverse(filter_request_t * req, filter_rule_t * start_rule,
+                        int whitelisted)
+{
+    filter_index_t *index;
+    filter_rule_t  *rule;
+    apr_pool_t     *scratch;
+    uint32_t       *bits;
+    uint32_t        id,
+                    first,
+                    end,
+                    i;
+
+    if (!req)
+        return NULL;
 
-            if (flows->next_operator == RULE_MATCH_OPERATOR_AND) {
-                PRINT_DEBUG
-                    ("Next operator is an AND, continue flow processing\n");
-                flows = flows->next;
+    if (start_rule)
+        rule = start_rule;
+    else
+        rule = req->filter->head;
+
+    if (!rule)
+        return NULL;
+
+    scratch = req->scratch;
+    index = req->index;
+
+    if (!index || rule->id >= index->nrules || index->rules[rule->id] != rule) {
+        for (;rule != NULL;rule = rule->next) {
+            if (whitelisted && !rule->ignore_whitelist)
                 continue;
-            }
 
-            if (flows->next_operator == 0) {
-                PRINT_DEBUG("Reached end of flow processing\n");
-                matched_rule = 1;
+            if (filter_match_rulen(scratch, req, rule) == 1)
                 break;
-            }
+
+            apr_pool_clear(scratch);
         }
 
-        matched_rule = 0;
+        apr_pool_clear(scratch);
+        return rule;
+    }
+
+    end = rule->id < index->nlisted ? index->nlisted : index->nrules;
+    first = rule->id;
+    rule = NULL;
+
+    /*
+     * with bitset_eval every rule was matched already, otherwise walk
+     * only the rules which can match, still in order. The whitelist rule
+     * is numbered after the rules of the list and traversed alone.
+     */
+    if (req->results) {
+        if (!req->have_results)
+            filter_request_evaluate(req);
+
+        bits = req->results;
+    } else {
+        if (!req->have_candidates)
+            filter_request_candidates(req);
 
-        PRINT_DEBUG("FLOW did NOT match!\n");
+        bits = req->candidates;
+    }
 
+    if (whitelisted && end == index->nlisted) {
         /*
-         * we didn't match this, we need to find the next OR flow 
+         * a whitelisted request only goes through the rules ignoring the
+         * whitelist
          */
-        rule_flow_t    *find_or_flow = flows;
-
-        while (find_or_flow != NULL) {
-            if (find_or_flow->next_operator == RULE_MATCH_OPERATOR_OR) {
-                /*
-                 * found that the next operator is OR, so set the current 
-                 * flow to this, we let the final flows = flows->next
-                 * handle the transition 
-                 */
-                flows = find_or_flow;
+        for (i = 0; i < index->nignoring; i++) {
+            id = index->ignoring[i];
+
+            if (id < first || !FILTER_INDEX_TEST(bits, id))
+                continue;
+
+            if (filter_request_match_id(req, scratch, id)) {
+                rule = index->rules[id];
                 break;
             }
-            find_or_flow = find_or_flow->next;
+
+            apr_pool_clear(scratch);
         }
 
-        if (!find_or_flow)
+        apr_pool_clear(scratch);
+        return rule;
+    }
+
+    for (id = filter_next_candidate(bits, first, end);
+         id < end; id = filter_next_candidate(bits, id + 1, end)) {
+        if (whitelisted && !index->rules[id]->ignore_whitelist)
+            continue;
+
+        if (filter_request_match_id(req, scratch, id)) {
+            rule = index->rules[id];
             break;
+        }
 
-        flows = flows->next;
+        apr_pool_clear(scratch);
     }
 
-    return matched_rule;
+    apr_pool_clear(scratch);
+    return rule;
+}
+
+/*
+ * whether the request's source address is on the whitelist. A whitelist
+ * read from a file is a single match_src_addrs term, which is matched
+ * directly, anything else is traversed like any other rule.
+ */
+int
+filter_request_whitelisted(filter_request_t * req)
+{
+    filter_rule_t  *rule = req->filter->whitelist_rule;
+    rule_flow_t    *flow;
+    int             whitelisted;
+
+    if (!rule || !rule->flow)
+        return 0;
+
+    flow = rule->flow;
+
+    if (rule->flow_len != 1 || flow->type != RULE_MATCH_SRCADDR ||
+        flow->on_true != FILTER_FLOW_ACCEPT ||
+        flow->on_false != FILTER_FLOW_REJECT)
+        return filter_request_traverse(req, rule, 0) != NULL;
+
+    whitelisted = filter_match_flow(req->scratch, req, rule, flow);
+    apr_pool_clear(req->scratch);
+
+    return whitelisted;
 }
 
 filter_rule_t  *
@@ -884,30 +1951,219 @@ filter_traverse_filter(filter_t * filter, filter_rule_t * start_rule,
                        int whitelisted, const void *usrdata)
 {
     filter_rule_t  *rule;
-    apr_pool_t     *subpool;
+    apr_pool_t     *pool;
 
     if (!filter)
         return NULL;
 
-    if (start_rule)
-        rule = start_rule;
-    else
-        rule = filter->head;
+    apr_pool_create(&pool, NULL);
+
+    rule = filter_request_traverse(filter_request_init(pool, filter, usrdata),
+                                   start_rule, whitelisted);
+
+    apr_pool_destroy(pool);
+    return rule;
+}
+
+/*
+ * the regset of a group of regexes, compiled the first time a term on
+ * the group is bound. If it can't be, the term runs the regexes one by
+ * one.
+ */
+static regset_t *
+filter_regset_get(filter_t * filter, apr_array_header_t * regexes)
+{
+    regset_t       *regset;
+    int             i,
+                    compiled = 0;
+
+    if (!filter->regsets)
+        filter->regsets = apr_hash_make(filter->pool);
+
+    if ((regset = apr_hash_get(filter->regsets, &regexes, sizeof(regexes))))
+        return regset;
+
+    regset = regset_make(filter->pool);
+
+    for (i = 0; i < regexes->nelts; i++) {
+        filter_regex_t *regex = ((filter_regex_t **) regexes->elts)[i];
+
+        compiled += regset_add(regset, regex->pattern, &regex->regex,
+                               regex->literal, i);
+    }
+
+    if (regset_finish(regset) == -1)
+        return NULL;
+
+    PRINT_DEBUG("%d of %d regexes compiled into a regset\n",
+                compiled, regexes->nelts);
+
+    apr_hash_set(filter->regsets,
+                 apr_pmemdup(filter->pool, &regexes, sizeof(regexes)),
+                 sizeof(regexes), regset);
+
+    return regset;
+}
+
+/*
+ * the flat set of the plain values of a group, NULL if it has none
+ */
+static strset_t *
+filter_strset_get(filter_t * filter, apr_hash_t * values)
+{
+    strset_t       *set;
+    apr_hash_index_t *hi;
+    int             count;
 
-    apr_pool_create(&subpool, NULL);
+    if (!filter->strsets)
+        filter->strsets = apr_hash_make(filter->pool);
 
-    for (;rule != NULL;rule = rule->next) {
-        if (whitelisted && !rule->ignore_whitelist)
+    if ((set = apr_hash_get(filter->strsets, &values, sizeof(values))))
+        return set;
+
+    count = apr_hash_count(values);
+
+    if (apr_hash_get(values, REGEX_KEY, APR_HASH_KEY_STRING))
+        count--;
+
+    if (apr_hash_get(values, FIXED_KEY, APR_HASH_KEY_STRING))
+        count--;
+
+    if (!count)
+        return NULL;
+
+    set = strset_make(filter->pool, count);
+
+    for (hi = apr_hash_first(NULL, values); hi;
+         hi = apr_hash_next(hi)) {
+        const void     *value;
+        void           *data;
+
+        apr_hash_this(hi, &value, NULL, &data);
+
+        if (!strcmp(value, REGEX_KEY) || !strcmp(value, FIXED_KEY))
             continue;
 
-        if (filter_match_rulen(subpool, filter, rule, usrdata) == 1)
-            break;
+        strset_add(set, value, data);
+    }
+
+    apr_hash_set(filter->strsets,
+                 apr_pmemdup(filter->pool, &values, sizeof(values)),
+                 sizeof(values), set);
+
+    return set;
+}
+
+/*
+ * likewise the matcher of a group of fixed strings
+ */
+static strmatch_t *
+filter_strmatch_get(filter_t * filter, apr_array_header_t * fixed)
+{
+    strmatch_t     *strmatch;
+    int             i;
+
+    if (!filter->strmatches)
+        filter->strmatches = apr_hash_make(filter->pool);
+
+    if ((strmatch = apr_hash_get(filter->strmatches, &fixed,
+                                 sizeof(fixed))))
+        return strmatch;
 
-        apr_pool_clear(subpool);
+    strmatch = strmatch_make(filter->pool);
+
+    for (i = 0; i < fixed->nelts; i++) {
+        filter_fixed_t *f = &((filter_fixed_t *) fixed->elts)[i];
+
+        strmatch_add(strmatch, f->string,
+                     f->type == FILTER_STRING_PREFIX ? STRMATCH_PREFIX :
+                     f->type == FILTER_STRING_SUFFIX ? STRMATCH_SUFFIX :
+                     STRMATCH_CONTAINS, i);
     }
 
-    apr_pool_destroy(subpool);
-    return rule;
+    if (strmatch_finish(strmatch) == -1)
+        return NULL;
+
+    apr_hash_set(filter->strmatches,
+                 apr_pmemdup(filter->pool, &fixed, sizeof(fixed)),
+                 sizeof(fixed), strmatch);
+
+    return strmatch;
+}
+
+static void
+filter_rule_bind_flows(filter_t * filter, filter_rule_t * rule)
+{
+    /*
+     * resolve, once, the callback fetching each term's data and for
+     * string terms the rule's group of values for the term's key. 
+     */
+    int             i;
+
+    for (i = 0; rule->flow && i < rule->flow_len; i++) {
+        rule_flow_t    *flow = &rule->flow[i];
+
+        switch (flow->type) {
+        case RULE_MATCH_NOT_SRCADDR:
+        case RULE_MATCH_SRCADDR:
+            flow->fetch = filter->callbacks.src_addr_cb;
+            flow->fact = FILTER_FACT_SRCADDR;
+            break;
+        case RULE_MATCH_NOT_DSTADDR:
+        case RULE_MATCH_DSTADDR:
+            flow->fetch = filter->callbacks.dst_addr_cb;
+            flow->fact = FILTER_FACT_DSTADDR;
+            break;
+        case RULE_MATCH_NOT_STRING:
+        case RULE_MATCH_STRING:
+            flow->fetch = NULL;
+            flow->values = NULL;
+            flow->fixed = NULL;
+            flow->regexes = NULL;
+            flow->fact = filter_fact_id(filter, flow->user_data);
+
+            if (!flow->term)
+                flow->term = ++filter->term_count;
+
+            if (filter->callbacks.string_callbacks)
+                flow->fetch =
+                    apr_hash_get(filter->callbacks.string_callbacks,
+                                 flow->user_data, APR_HASH_KEY_STRING);
+
+            if (rule->strings)
+                flow->values = apr_hash_get(rule->strings, flow->user_data,
+                                            APR_HASH_KEY_STRING);
+
+            if (flow->values) {
+                flow->fixed = apr_hash_get(flow->values, FIXED_KEY,
+                                           APR_HASH_KEY_STRING);
+                flow->regexes = apr_hash_get(flow->values, REGEX_KEY,
+                                             APR_HASH_KEY_STRING);
+            }
+
+            flow->set = NULL;
+            flow->strmatch = NULL;
+            flow->regset = NULL;
+
+            /*
+             * with an index the value is matched against every rule's
+             * group for the key at once, there is nothing to build for
+             * the group alone
+             */
+            if (!flow->fetch || filter->index)
+                break;
+
+            if (flow->values)
+                flow->set = filter_strset_get(filter, flow->values);
+
+            if (flow->fixed)
+                flow->strmatch = filter_strmatch_get(filter, flow->fixed);
+
+            if (flow->regexes && flow->regexes->nelts)
+                flow->regset = filter_regset_get(filter, flow->regexes);
+            break;
+        }
+    }
 }
 
 int
@@ -915,6 +2171,9 @@ filter_register_user_cb(filter_t * filter,
                         void *(*cb) (apr_pool_t * p, void *fc_data,
                                      const void *d), int type, void *data)
 {
+    filter_rule_t  *rule;
+    char           *key;
+
     /*
      * If a callback isn't registered for a specific
      * datatype, the rule will not even attempt to match
@@ -928,16 +2187,44 @@ filter_register_user_cb(filter_t * filter,
         filter->callbacks.dst_addr_cb = cb;
         break;
     case RULE_MATCH_STRING:
-        if (!filter->callbacks.string_callbacks)
+        if (!filter->callbacks.string_callbacks) {
             filter->callbacks.string_callbacks
                 = apr_hash_make(filter->pool);
+            filter->fact_ids = apr_hash_make(filter->pool);
+        }
+
+        key = apr_pstrdup(filter->pool, data);
 
         apr_hash_set(filter->callbacks.string_callbacks,
-                     (char *) apr_pstrdup(filter->pool, data),
-                     APR_HASH_KEY_STRING, (void *) cb);
+                     key, APR_HASH_KEY_STRING, (void *) cb);
+
+        /*
+         * a key registered again keeps the fact id it already had 
+         */
+        if (filter_fact_id(filter, key) == -1) {
+            int            *id = apr_palloc(filter->pool, sizeof(int));
+
+            *id = filter->fact_count++;
+            apr_hash_set(filter->fact_ids, key, APR_HASH_KEY_STRING, id);
+        }
+
+        if (filter->index)
+            filter_index_bind(filter->index, key,
+                              filter_fact_id(filter, key));
         break;
 
     }
+
+    /*
+     * and hand the callback to every term that needs it, nothing is
+     * looked up by name while matching. 
+     */
+    for (rule = filter->head; rule; rule = rule->next)
+        filter_rule_bind_flows(filter, rule);
+
+    if (filter->whitelist_rule)
+        filter_rule_bind_flows(filter, filter->whitelist_rule);
+
     return 0;
 }
 
@@ -1003,6 +2290,9 @@ filter_parse_config(apr_pool_t * pool, const char *filename, int do_whitelist)
     PRINT_DEBUG("Parsing configuration from %s.\n", filename);
     cfg_opt_t       str_match_opts[] = {
         CFG_STR_LIST("values", 0, CFGF_MULTI),
+        CFG_STR_LIST("contains", 0, CFGF_MULTI),
+        CFG_STR_LIST("prefix", 0, CFGF_MULTI),
+        CFG_STR_LIST("suffix", 0, CFGF_MULTI),
         CFG_STR_LIST("regex", 0, CFGF_MULTI),
         CFG_END()
     };
@@ -1095,9 +2385,12 @@ filter_parse_config(apr_pool_t * pool, const char *filename, int do_whitelist)
 
         if (flow) {
             PRINT_DEBUG("Found flow '%s'\n", flow);
-            filter_rule_add_flow(filter_rule,
-                                 (char *) apr_pstrdup(filter_rule->pool,
-                                                      flow));
+            /*
+             * a rule with a flow that doesn't compile never matches 
+             */
+            if (filter_rule_add_flow(filter_rule, flow) == -1)
+                cfg_error(cfg, "rule %s: syntax error in flow '%s'",
+                          filter_rule->name, flow);
         }
 
         if ((action = cfg_getstr(rule, "action")))
@@ -1145,7 +2438,37 @@ filter_parse_config(apr_pool_t * pool, const char *filename, int do_whitelist)
 
                 filter_rule_add_string(filter_rule,
                                        (char *) cfg_title(matcher), str,
-                                       0);
+                                       FILTER_STRING_VALUE);
+            }
+
+            for (value_cnt = 0; value_cnt < cfg_size(matcher, "contains");
+                 value_cnt++) {
+                char           *str =
+                    cfg_getnstr(matcher, "contains", value_cnt);
+
+                filter_rule_add_string(filter_rule,
+                                       (char *) cfg_title(matcher), str,
+                                       FILTER_STRING_CONTAINS);
+            }
+
+            for (value_cnt = 0; value_cnt < cfg_size(matcher, "prefix");
+                 value_cnt++) {
+                char           *str =
+                    cfg_getnstr(matcher, "prefix", value_cnt);
+
+                filter_rule_add_string(filter_rule,
+                                       (char *) cfg_title(matcher), str,
+                                       FILTER_STRING_PREFIX);
+            }
+
+            for (value_cnt = 0; value_cnt < cfg_size(matcher, "suffix");
+                 value_cnt++) {
+                char           *str =
+                    cfg_getnstr(matcher, "suffix", value_cnt);
+
+                filter_rule_add_string(filter_rule,
+                                       (char *) cfg_title(matcher), str,
+                                       FILTER_STRING_SUFFIX);
             }
 
             for (value_cnt = 0; value_cnt < cfg_size(matcher, "regex");
@@ -1155,7 +2478,7 @@ filter_parse_config(apr_pool_t * pool, const char *filename, int do_whitelist)
 
                 filter_rule_add_string(filter_rule,
                                        (char *) cfg_title(matcher), str,
-                                       1);
+                                       FILTER_STRING_REGEX);
             }
 
         }
@@ -1166,7 +2489,7 @@ filter_parse_config(apr_pool_t * pool, const char *filename, int do_whitelist)
             ud_rule = filter_get_rule(filter, update_rule);
 
             if (ud_rule)
-                filter_rule->update_rule = ud_rule;
+                filter_rule_set_update_rule(filter, filter_rule, ud_rule);
         }
 
         if (!flow) {
@@ -1216,9 +2539,7 @@ filter_parse_config(apr_pool_t * pool, const char *filename, int do_whitelist)
 
             PRINT_DEBUG("GENERATED FLOW %s\n", flowstr);
 
-            filter_rule_add_flow(filter_rule,
-                                 (char *) apr_pstrdup(filter_rule->pool,
-                                                      flowstr));
+            filter_rule_add_flow(filter_rule, flowstr);
 
 
             apr_pool_destroy(tpool);
@@ -1228,6 +2549,12 @@ filter_parse_config(apr_pool_t * pool, const char *filename, int do_whitelist)
         filter_add_rule(filter, filter_rule);
     }
 
+    if (filter_index_build(filter) == -1) {
+        cfg_error(cfg, "Unable to index the rules of %s", filename);
+        cfg_free(cfg);
+        return NULL;
+    }
+
     cfg_free(cfg);
 
     return filter;
@@ -1,15 +1,25 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
 #include <unistd.h>
+#include <regex.h>
 #include "apr.h"
 #include "apr_hash.h"
 #include "apr_pools.h"
 #include "apr_strings.h"
 #include "apr_tables.h"
 #include "apr_network_io.h"
+#include "apr_thread_rwlock.h"
 #include "patricia.h"
+#include "regset.h"
+#include "strmatch.h"
+#include "strset.h"
 
 typedef struct filter_rule filter_rule_t;
 typedef struct rule_flow rule_flow_t;
 typedef struct filter_callbacks filter_callbacks_t;
+typedef struct filter_request filter_request_t;
+typedef struct filter_index filter_index_t;
 
 #define FILTER_DENY                 1
 #define FILTER_PERMIT               2
@@ -44,16 +54,51 @@ typedef struct filter_callbacks filter_callbacks_t;
 #endif
 #endif
 
+/*
+ * a compiled flow is an array of these, evaluation starts at the first
+ * term and follows on_true or on_false depending on whether the term
+ * matched, until it reaches FILTER_FLOW_ACCEPT or FILTER_FLOW_REJECT.
+ * Jumps only ever go forward.
+ */
+#define FILTER_FLOW_ACCEPT -1
+#define FILTER_FLOW_REJECT -2
+
 struct rule_flow {
     int             type;
     int             (*callback) (apr_pool_t * pool,
                                  filter_rule_t * rule, 
-                                 void *data, void *usrdata);
+                                 void *data, rule_flow_t * flow);
     void            *user_data;
 
-    int             this_operator;
-    int             next_operator;
-    struct rule_flow *next;
+    int             on_true;
+    int             on_false;
+
+    /*
+     * bound by filter_register_user_cb(): the application callback
+     * fetching this term's data and, for string terms, the rule's values,
+     * fixed strings and regexes for the term's key. 
+     */
+    void           *(*fetch) (apr_pool_t * pool, void *fc_data,
+                              const void *usrdata);
+    apr_hash_t     *values;
+    strset_t       *set;
+    apr_array_header_t *fixed;
+    strmatch_t     *strmatch;
+    apr_array_header_t *regexes;
+    regset_t       *regset;
+
+    /*
+     * the slot of a request's fact table this term's data is kept in
+     */
+    int             fact;
+
+    /*
+     * for string terms, the slot of a request's term table their outcome
+     * is kept in, numbered from 1 the first time the term is bound. 0 for
+     * address terms, which are matched again whenever the address
+     * changes.
+     */
+    int             term;
 };
 
 struct filter_callbacks {
@@ -65,9 +110,80 @@ struct filter_callbacks {
   apr_hash_t *string_callbacks;
 };
 
+/*
+ * the key within a match_string group holding its array of regexes 
+ */
+#define REGEX_KEY "$_R_$_E_$_G_$_X_$"
+
+/*
+ * the key within a match_string group holding its array of fixed
+ * strings: substrings, prefixes and suffixes
+ */
+#define FIXED_KEY "$_F_$_I_$_X_$_E_$_D_$"
+
+/*
+ * what a match_string value is compared to the input as: the whole of
+ * it, a regex, a substring, a prefix or a suffix
+ */
+#define FILTER_STRING_VALUE    0
+#define FILTER_STRING_REGEX    1
+#define FILTER_STRING_CONTAINS 2
+#define FILTER_STRING_PREFIX   3
+#define FILTER_STRING_SUFFIX   4
+
+/*
+ * every distinct piece of data the flows ask the application for gets a
+ * fact id: the addresses have fixed ones, the keys of string callbacks
+ * are numbered from FILTER_FACT_STRINGS up as they are registered.
+ */
+#define FILTER_FACT_SRCADDR    0
+#define FILTER_FACT_DSTADDR    1
+#define FILTER_FACT_STRINGS    2
+
 #define FILTER_RULE_IP_ADD     (void *)0
 #define FILTER_RULE_IP_SUB     (void *)1
 
+/*
+ * a match_string regex, the pattern is kept around next to the compiled
+ * version so that a filter can be written back out as an image.
+ */
+typedef struct filter_regex {
+    const char         *pattern;
+    regex_t             regex;
+    /*
+     * a string the pattern can't match without, NULL if there is none
+     */
+    const char         *literal;
+} filter_regex_t;
+
+/*
+ * a match_string substring, prefix or suffix, type being one of the
+ * FILTER_STRING_ types. Regexes amounting to a fixed string are stored
+ * as one, as are those amounting to a value: these are kept in the
+ * group's hash with their pattern in place of the usual 1.
+ */
+typedef struct filter_fixed {
+    const char         *string;
+    int                 type;
+    /*
+     * the regex the string was lowered from, NULL if it was given as is
+     */
+    const char         *regex;
+} filter_fixed_t;
+
+/*
+ * addresses inserted by an update-rule while requests are being served.
+ * These live outside of the rule's load-time trees (which are only ever
+ * read once the filter is built) and are guarded by their own lock.
+ */
+typedef struct filter_dynamic {
+#ifdef APR_HAS_THREADS
+    apr_thread_rwlock_t *rwlock;
+#endif
+    apr_pool_t         *pool;
+    patricia_tree_t    *src_addrs;
+} filter_dynamic_t;
+
 struct filter_rule {
     char               *name;
     int                 action;
@@ -79,12 +195,22 @@ struct filter_rule {
     patricia_tree_t    *dst_addrs;
     apr_hash_t         *strings;
     uint8_t             strings_have_regex;
+    /*
+     * regexes stored as a value or fixed string instead
+     */
+    uint32_t            regexes_lowered;
     rule_flow_t        *flow;
+    int                 flow_len;
     apr_pool_t         *pool;
     char               *redirect_url;
     char                redirect_question;
     struct filter_rule *next;
     struct filter_rule *update_rule;
+    filter_dynamic_t   *dynamic;
+    /*
+     * position of the rule in the filter, numbered by filter_index_build()
+     */
+    uint32_t            id;
 };
 
 typedef struct filter {
@@ -92,10 +218,116 @@ typedef struct filter {
     filter_rule_t      *head;
     filter_rule_t      *tail;
     apr_pool_t        *pool;
+    /*
+     * state written while serving requests (update-rule trees and their
+     * locks) is carved out of its own pool so that it never shares a page
+     * with the ruleset proper; a filter built before fork() then stays
+     * shared between children instead of being copied page by page.
+     */
+    apr_pool_t        *dynamic_pool;
     struct filter_callbacks  callbacks; 
     uint32_t        rule_count;
+    /*
+     * string callback key -> fact id, and the number of ids handed out
+     */
+    apr_hash_t        *fact_ids;
+    int                fact_count;
+    /*
+     * the number of string terms handed a slot in the term table
+     */
+    int                term_count;
+    filter_index_t    *index;
+    /*
+     * evaluate every rule at once, a bit per rule, the first time a
+     * request is traversed instead of walking the rules one by one (see
+     * filter_request_evaluate()).
+     */
+    uint8_t            bitset_eval;
+    /*
+     * the compiled regset of every group of regexes bound to a term,
+     * keyed by the group's array
+     */
+    apr_hash_t        *regsets;
+    /*
+     * likewise for the automatons of groups of fixed strings and the
+     * value sets of groups
+     */
+    apr_hash_t        *strmatches;
+    apr_hash_t        *strsets;
 } filter_t;
 
+/*
+ * an address fact, parsed once when it is fetched. The address terms are
+ * handed a pointer to one of these (NULL if there was no address or it
+ * could not be parsed) instead of the string the application returned.
+ */
+typedef struct filter_addr {
+    int                 family;
+    u_int               bitlen;
+    u_char              addr[16];
+    /*
+     * with a filter_index, the rules whose load-time tree holds the
+     * address as a '+' and as a '-' prefix, one bit per rule id. 
+     */
+    uint32_t           *add;
+    uint32_t           *sub;
+} filter_addr_t;
+
+/*
+ * a string fact, hashed once when it is fetched. The string terms are
+ * handed a pointer to one of these (NULL if there was no value).
+ */
+typedef struct filter_string {
+    strset_key_t        key;
+    /*
+     * with a filter_index, the rules whose group for the key the value
+     * hits, one bit per rule id.
+     */
+    uint32_t           *hits;
+} filter_string_t;
+
+/*
+ * the facts fetched while matching one request. Each one is fetched the
+ * first time a term needs it and then shared by all the rules traversed
+ * with the same filter_request_t. 
+ */
+struct filter_request {
+    filter_t           *filter;
+    apr_pool_t         *pool;
+    /*
+     * scratch space for the matchers, a child of pool made once and
+     * cleared after every rule, so it keeps its memory from one rule to
+     * the next and never goes back to the allocator
+     */
+    apr_pool_t         *scratch;
+    const void         *usrdata;
+    void              **facts;
+    uint8_t            *fetched;
+    /*
+     * the outcome of each string term once it has been matched: 0 if it
+     * hasn't been yet, 1 if it did not match and 2 if it did. These do
+     * not depend on the addresses and outlive filter_request_forget() of
+     * either of them.
+     */
+    uint8_t            *terms;
+    filter_addr_t       addrs[FILTER_FACT_STRINGS];
+    filter_string_t    *strings;
+    /*
+     * the filter's index when the request started, and the rules it
+     * says can match this request (valid while have_candidates is set)
+     */
+    filter_index_t     *index;
+    uint32_t           *candidates;
+    int                 have_candidates;
+    /*
+     * with bitset_eval, the rules which match this request (valid while
+     * have_results is set), and room for working them out
+     */
+    uint32_t           *results;
+    uint32_t           *reach;
+    int                 have_results;
+};
+
 enum {
     RULE_MATCH_SRCADDR = 1,
     RULE_MATCH_DSTADDR,
@@ -108,16 +340,35 @@ enum {
     RULE_MATCH_NOT_STRING
 };
 
-rule_flow_t *filter_rule_flow_init(apr_pool_t *);
+rule_flow_t *filter_rule_flow_init(apr_pool_t *, int);
 filter_t *filter_init(apr_pool_t *);
+filter_rule_t *filter_rule_init(apr_pool_t *);
+int filter_add_rule(filter_t *, filter_rule_t *);
 int filter_match_rule(apr_pool_t *, filter_rule_t *, const char *, 
     const char *, const void *);
 filter_rule_t *filter_traverse_filter(filter_t *, filter_rule_t *, int whitelisted, const void *);
+filter_request_t *filter_request_init(apr_pool_t *, filter_t *, const void *);
+void filter_request_set_usrdata(filter_request_t *, const void *);
+void filter_request_forget(filter_request_t *, int);
+filter_rule_t *filter_request_traverse(filter_request_t *, filter_rule_t *, int whitelisted);
+int filter_request_whitelisted(filter_request_t *);
+int filter_fact_id(filter_t *, const char *);
 filter_t *filter_parse_config(apr_pool_t *, const char *, int);
 char **filter_tokenize_str(char *, const char *, int *nelts);
 void free_tokens(char **);
 int filter_register_user_cb(filter_t *, 
   void *(*cb)(apr_pool_t *, void *, const void *), int, void *);
 filter_rule_t *filter_get_rule(filter_t *filter, const char *rule_name);
+uint32_t filter_regexes_lowered(filter_t *);
 int filter_rule_add_network(filter_rule_t *, const char *, const int);
+int filter_rule_update_network(filter_rule_t *, const char *);
+int filter_rule_add_prefix(filter_rule_t *, const int, int, 
+    const void *, int, void *);
+int filter_rule_insert_string(filter_rule_t *, char *, char *, const int);
+int filter_rule_flow_set(rule_flow_t *, int, char *, int, int);
+int filter_rule_set_update_rule(filter_t *, filter_rule_t *, filter_rule_t *);
+int filter_dynamic_attach(filter_t *, apr_pool_t *);
+int filter_regset_attach(filter_t *, apr_pool_t *);
 int filter_validate_ip(char *);
+
+#endif                          /* _FILTER_H */
@@ -0,0 +1,719 @@
+/******************************************************************************/
+/* filter_image.c  -- precompiled filter images
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "apr_file_io.h"
+#include "apr_mmap.h"
+#include "filter_image.h"
+#include "filter_index.h"
+
+/*
+ * everything needed to lay a filter out as an image, each table is
+ * appended to while walking the rules and written out in one go.
+ */
+typedef struct filter_image_builder {
+    apr_pool_t         *pool;
+    apr_array_header_t *rules;
+    apr_array_header_t *prefixes;
+    apr_array_header_t *flows;
+    apr_array_header_t *values;
+    apr_array_header_t *strings;
+    apr_hash_t         *string_offsets;
+} filter_image_builder_t;
+
+static uint32_t
+image_add_string(filter_image_builder_t * b, const char *str)
+{
+    /*
+     * identical strings (group keys, mostly) are only stored once. The
+     * hash holds offset + 1 so that offset 0 can be told from a miss.
+     */
+    uintptr_t       off;
+    size_t          len;
+    size_t          i;
+
+    if (!str)
+        return FILTER_IMAGE_NULL;
+
+    if ((off = (uintptr_t) apr_hash_get(b->string_offsets, str,
+                                        APR_HASH_KEY_STRING)))
+        return (uint32_t) (off - 1);
+
+    off = b->strings->nelts;
+    len = strlen(str) + 1;
+
+    for (i = 0; i < len; i++)
+        *(char *) apr_array_push(b->strings) = str[i];
+
+    apr_hash_set(b->string_offsets, str, APR_HASH_KEY_STRING,
+                 (void *) (off + 1));
+
+    return (uint32_t) off;
+}
+
+static void
+image_add_tree(filter_image_builder_t * b, patricia_tree_t * tree,
+               filter_image_range_t * range)
+{
+    patricia_node_t *node;
+
+    range->count = 0;
+
+    /*
+     * a rule without a tree and a rule with an empty one do not match the
+     * same way, keep them apart.
+     */
+    if (!tree) {
+        range->first = FILTER_IMAGE_NULL;
+        return;
+    }
+
+    range->first = b->prefixes->nelts;
+
+    PATRICIA_WALK(tree->head, node) {
+        filter_image_prefix_t *p;
+
+        p = (filter_image_prefix_t *) apr_array_push(b->prefixes);
+        memset(p, 0, sizeof(*p));
+
+        p->bitlen = node->prefix->bitlen;
+        p->sub = node->data == FILTER_RULE_IP_SUB;
+
+        if (node->prefix->family == AF_INET6) {
+            p->family = 6;
+            memcpy(p->addr, &node->prefix->add.sin6, 16);
+        } else {
+            p->family = 4;
+            memcpy(p->addr, &node->prefix->add.sin, 4);
+        }
+
+        range->count++;
+    } PATRICIA_WALK_END;
+}
+
+static void
+image_add_value(filter_image_builder_t * b, uint32_t key,
+                const char *value, uint32_t type)
+{
+    filter_image_value_t *v;
+
+    v = (filter_image_value_t *) apr_array_push(b->values);
+    v->key = key;
+    v->value = image_add_string(b, value);
+    v->type = type;
+}
+
+static void
+image_add_strings(filter_image_builder_t * b, apr_hash_t * strings,
+                  filter_image_range_t * range)
+{
+    apr_hash_index_t *hi;
+
+    range->first = b->values->nelts;
+    range->count = 0;
+
+    if (!strings)
+        return;
+
+    for (hi = apr_hash_first(b->pool, strings); hi; hi = apr_hash_next(hi)) {
+        apr_hash_index_t *vhi;
+        apr_hash_t     *group;
+        const void     *key;
+        uint32_t        key_off;
+        int             nvalues;
+
+        apr_hash_this(hi, &key, NULL, (void **) &group);
+        key_off = image_add_string(b, key);
+        nvalues = 0;
+
+        for (vhi = apr_hash_first(b->pool, group); vhi;
+             vhi = apr_hash_next(vhi)) {
+            apr_array_header_t *regex_array;
+            const void     *value;
+            int             i;
+
+            apr_hash_this(vhi, &value, NULL, (void **) &regex_array);
+
+            if (!strcmp(value, FIXED_KEY)) {
+                apr_array_header_t *fixed = regex_array;
+
+                /*
+                 * a lowered regex is written out as the regex, it is
+                 * lowered again when the image is loaded
+                 */
+                for (i = 0; i < fixed->nelts; i++) {
+                    filter_fixed_t *f = &((filter_fixed_t *) fixed->elts)[i];
+
+                    if (f->regex)
+                        image_add_value(b, key_off, f->regex,
+                                        FILTER_STRING_REGEX);
+                    else
+                        image_add_value(b, key_off, f->string, f->type);
+                }
+
+                nvalues++;
+                continue;
+            }
+
+            if (strcmp(value, REGEX_KEY)) {
+                if (regex_array == (void *) 1)
+                    image_add_value(b, key_off, value, FILTER_STRING_VALUE);
+                else
+                    image_add_value(b, key_off, (const char *) regex_array,
+                                    FILTER_STRING_REGEX);
+                nvalues++;
+                continue;
+            }
+
+            /*
+             * an empty regex array (every regex in the group failed to
+             * compile) is still recorded, it changes how the group
+             * matches.
+             */
+            if (!regex_array->nelts)
+                image_add_value(b, key_off, NULL, FILTER_STRING_REGEX);
+
+            for (i = 0; i < regex_array->nelts; i++)
+                image_add_value(b, key_off,
+                                ((filter_regex_t **) regex_array->
+                                 elts)[i]->pattern, FILTER_STRING_REGEX);
+
+            nvalues++;
+        }
+
+        if (!nvalues)
+            image_add_value(b, key_off, NULL, FILTER_STRING_VALUE);
+    }
+
+    range->count = b->values->nelts - range->first;
+}
+
+static void
+image_add_flow(filter_image_builder_t * b, filter_rule_t * rule,
+               filter_image_range_t * range)
+{
+    uint32_t        i;
+
+    range->first = b->flows->nelts;
+    range->count = rule->flow ? rule->flow_len : 0;
+
+    for (i = 0; i < range->count; i++) {
+        filter_image_flow_t *f;
+
+        f = (filter_image_flow_t *) apr_array_push(b->flows);
+        f->type = rule->flow[i].type;
+        f->on_true = rule->flow[i].on_true;
+        f->on_false = rule->flow[i].on_false;
+        f->user_data = image_add_string(b, rule->flow[i].user_data);
+    }
+}
+
+static uint32_t
+image_rule_index(filter_t * filter, filter_rule_t * rule)
+{
+    filter_rule_t  *r;
+    uint32_t        i;
+
+    for (i = 0, r = filter->head; r; r = r->next, i++)
+        if (r == rule)
+            return i;
+
+    return FILTER_IMAGE_NULL;
+}
+
+static void
+image_add_rule(filter_image_builder_t * b, filter_t * filter,
+               filter_rule_t * rule)
+{
+    filter_image_rule_t *r;
+
+    r = (filter_image_rule_t *) apr_array_push(b->rules);
+    memset(r, 0, sizeof(*r));
+
+    r->name = image_add_string(b, rule->name);
+    r->redirect_url = image_add_string(b, rule->redirect_url);
+    r->action = rule->action;
+    r->status_code = rule->status_code;
+    r->log = rule->log;
+    r->send_method = rule->send_method;
+    r->ignore_whitelist = rule->ignore_whitelist;
+    r->redirect_question = rule->redirect_question;
+    r->update_rule = rule->update_rule ?
+        image_rule_index(filter, rule->update_rule) : FILTER_IMAGE_NULL;
+
+    image_add_tree(b, rule->src_addrs, &r->src_addrs);
+    image_add_tree(b, rule->dst_addrs, &r->dst_addrs);
+    image_add_flow(b, rule, &r->flow);
+    image_add_strings(b, rule->strings, &r->strings);
+}
+
+static apr_status_t
+image_write_array(apr_file_t * fd, apr_array_header_t * arr)
+{
+    if (!arr->nelts)
+        return APR_SUCCESS;
+
+    return apr_file_write_full(fd, arr->elts,
+                               (apr_size_t) arr->nelts * arr->elt_size,
+                               NULL);
+}
+
+int
+filter_image_write(apr_pool_t * pool, filter_t * filter,
+                   const char *filename)
+{
+    /*
+     * the image is written next to its final name and renamed into
+     * place, a process which has the previous image mapped keeps on
+     * seeing the old one.
+     */
+    filter_image_builder_t b;
+    filter_image_hdr_t hdr;
+    filter_rule_t  *rule;
+    apr_pool_t     *subpool;
+    apr_file_t     *fd;
+    char           *tmpname;
+    uint64_t        size;
+    apr_status_t    rv;
+
+    if (!filter)
+        return -1;
+
+    apr_pool_create(&subpool, pool);
+
+    b.pool = subpool;
+    b.rules = apr_array_make(subpool, 64, sizeof(filter_image_rule_t));
+    b.prefixes = apr_array_make(subpool, 256,
+                                sizeof(filter_image_prefix_t));
+    b.flows = apr_array_make(subpool, 256, sizeof(filter_image_flow_t));
+    b.values = apr_array_make(subpool, 256, sizeof(filter_image_value_t));
+    b.strings = apr_array_make(subpool, 4096, sizeof(char));
+    b.string_offsets = apr_hash_make(subpool);
+
+    for (rule = filter->head; rule; rule = rule->next)
+        image_add_rule(&b, filter, rule);
+
+    if (filter->whitelist_rule)
+        image_add_rule(&b, filter, filter->whitelist_rule);
+
+    /*
+     * pad the string table so the image size stays a multiple of 4
+     */
+    while (b.strings->nelts % 4)
+        *(char *) apr_array_push(b.strings) = '\0';
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FILTER_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = FILTER_IMAGE_VERSION;
+    hdr.byte_order = FILTER_IMAGE_BYTE_ORDER;
+    hdr.rule_count = filter->rule_count;
+    hdr.has_whitelist = filter->whitelist_rule != NULL;
+
+    size = sizeof(hdr);
+    hdr.rules = size;
+    size += (uint64_t) b.rules->nelts * sizeof(filter_image_rule_t);
+    hdr.prefixes = size;
+    hdr.prefix_count = b.prefixes->nelts;
+    size += (uint64_t) b.prefixes->nelts * sizeof(filter_image_prefix_t);
+    hdr.flows = size;
+    hdr.flow_count = b.flows->nelts;
+    size += (uint64_t) b.flows->nelts * sizeof(filter_image_flow_t);
+    hdr.values = size;
+    hdr.value_count = b.values->nelts;
+    size += (uint64_t) b.values->nelts * sizeof(filter_image_value_t);
+    hdr.strings = size;
+    hdr.strings_size = b.strings->nelts;
+    size += b.strings->nelts;
+
+    if (size >= FILTER_IMAGE_NULL) {
+        PRINT_DEBUG("filter too large for an image\n");
+        apr_pool_destroy(subpool);
+        return -1;
+    }
+
+    hdr.size = size;
+
+    tmpname = apr_pstrcat(subpool, filename, ".XXXXXX", NULL);
+
+    if (apr_file_mktemp(&fd, tmpname,
+                        APR_CREATE | APR_WRITE | APR_EXCL | APR_BINARY,
+                        subpool) != APR_SUCCESS) {
+        apr_pool_destroy(subpool);
+        return -1;
+    }
+
+    rv = apr_file_write_full(fd, &hdr, sizeof(hdr), NULL);
+
+    if (rv == APR_SUCCESS)
+        rv = image_write_array(fd, b.rules);
+    if (rv == APR_SUCCESS)
+        rv = image_write_array(fd, b.prefixes);
+    if (rv == APR_SUCCESS)
+        rv = image_write_array(fd, b.flows);
+    if (rv == APR_SUCCESS)
+        rv = image_write_array(fd, b.values);
+    if (rv == APR_SUCCESS)
+        rv = image_write_array(fd, b.strings);
+
+    if (apr_file_close(fd) != APR_SUCCESS)
+        rv = APR_EGENERAL;
+
+    /*
+     * mktemp creates the file private to us, the image is likely read
+     * back by a less privileged user.
+     */
+    if (rv == APR_SUCCESS)
+        rv = apr_file_perms_set(tmpname, APR_UREAD | APR_UWRITE |
+                                APR_GREAD | APR_WREAD);
+    if (rv == APR_SUCCESS)
+        rv = apr_file_rename(tmpname, filename, subpool);
+
+    if (rv != APR_SUCCESS)
+        apr_file_remove(tmpname, subpool);
+
+    apr_pool_destroy(subpool);
+
+    return rv == APR_SUCCESS ? 0 : -1;
+}
+
+int
+filter_image_probe(const char *filename)
+{
+    FILE           *fp;
+    char            magic[4];
+    int             ret;
+
+    if (!filename || !(fp = fopen(filename, "r")))
+        return 0;
+
+    ret = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+        !memcmp(magic, FILTER_IMAGE_MAGIC, sizeof(magic));
+
+    fclose(fp);
+
+    return ret;
+}
+
+/*
+ * the mapped image, nothing in it is trusted until it has been bounds
+ * checked against the size of the mapping.
+ */
+typedef struct filter_image {
+    const char     *base;
+    const filter_image_hdr_t *hdr;
+} filter_image_t;
+
+#define IMAGE_TABLE_OK(hdr, off, count, type) \
+    ((uint64_t) (off) + (uint64_t) (count) * sizeof(type) <= (hdr)->size)
+
+#define IMAGE_RANGE_OK(range, total) \
+    ((uint64_t) (range).first + (range).count <= (total))
+
+static int
+image_string(filter_image_t * img, uint32_t off, char **str)
+{
+    if (off == FILTER_IMAGE_NULL) {
+        *str = NULL;
+        return 0;
+    }
+
+    if (off >= img->hdr->strings_size)
+        return -1;
+
+    *str = (char *) img->base + img->hdr->strings + off;
+    return 0;
+}
+
+static int
+image_load_tree(filter_image_t * img, filter_rule_t * rule,
+                filter_image_range_t range, int direction)
+{
+    const filter_image_prefix_t *p;
+    patricia_tree_t **tree;
+    uint32_t        i;
+
+    if (range.first == FILTER_IMAGE_NULL)
+        return 0;
+
+    if (!IMAGE_RANGE_OK(range, img->hdr->prefix_count))
+        return -1;
+
+    tree = direction == RULE_MATCH_SRCADDR ?
+        &rule->src_addrs : &rule->dst_addrs;
+    *tree = New_Patricia(rule->pool, 128);
+
+    p = (const filter_image_prefix_t *) (img->base + img->hdr->prefixes);
+
+    for (i = range.first; i < range.first + range.count; i++) {
+        int             family;
+
+        if (p[i].family == 4 && p[i].bitlen <= 32)
+            family = AF_INET;
+        else if (p[i].family == 6 && p[i].bitlen <= 128)
+            family = AF_INET6;
+        else
+            return -1;
+
+        if (filter_rule_add_prefix(rule, direction, family, p[i].addr,
+                                   p[i].bitlen,
+                                   p[i].sub ? FILTER_RULE_IP_SUB :
+                                   FILTER_RULE_IP_ADD) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+image_flow_target_ok(int32_t target, uint32_t pc, uint32_t count)
+{
+    /*
+     * a jump must go forward for evaluation to be sure to terminate
+     */
+    if (target == FILTER_FLOW_ACCEPT || target == FILTER_FLOW_REJECT)
+        return 1;
+
+    return target > 0 && (uint32_t) target > pc && (uint32_t) target < count;
+}
+
+static int
+image_load_flow(filter_image_t * img, filter_rule_t * rule,
+                filter_image_range_t range)
+{
+    const filter_image_flow_t *f;
+    uint32_t        i;
+
+    if (!IMAGE_RANGE_OK(range, img->hdr->flow_count))
+        return -1;
+
+    if (!range.count)
+        return 0;
+
+    f = (const filter_image_flow_t *) (img->base + img->hdr->flows) +
+        range.first;
+
+    rule->flow = filter_rule_flow_init(rule->pool, range.count);
+    rule->flow_len = range.count;
+
+    for (i = 0; i < range.count; i++) {
+        char           *user_data;
+
+        if (!image_flow_target_ok(f[i].on_true, i, range.count) ||
+            !image_flow_target_ok(f[i].on_false, i, range.count))
+            return -1;
+
+        if (image_string(img, f[i].user_data, &user_data) == -1)
+            return -1;
+
+        if (filter_rule_flow_set(&rule->flow[i], f[i].type, user_data,
+                                 f[i].on_true, f[i].on_false) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int
+image_load_strings(filter_image_t * img, filter_rule_t * rule,
+                   filter_image_range_t range)
+{
+    const filter_image_value_t *v;
+    uint32_t        i;
+
+    if (!IMAGE_RANGE_OK(range, img->hdr->value_count))
+        return -1;
+
+    v = (const filter_image_value_t *) (img->base + img->hdr->values);
+
+    for (i = range.first; i < range.first + range.count; i++) {
+        char           *key;
+        char           *value;
+
+        if (image_string(img, v[i].key, &key) == -1 || !key)
+            return -1;
+
+        if (image_string(img, v[i].value, &value) == -1)
+            return -1;
+
+        if (v[i].type > FILTER_STRING_SUFFIX)
+            return -1;
+
+        if (filter_rule_insert_string(rule, key, value, v[i].type) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static filter_rule_t *
+image_load_rule(filter_image_t * img, filter_t * filter,
+                const filter_image_rule_t * r)
+{
+    filter_rule_t  *rule;
+
+    if (!(rule = filter_rule_init(filter->pool)))
+        return NULL;
+
+    if (image_string(img, r->name, &rule->name) == -1 ||
+        image_string(img, r->redirect_url, &rule->redirect_url) == -1)
+        return NULL;
+
+    rule->action = r->action;
+    rule->status_code = r->status_code;
+    rule->log = r->log;
+    rule->send_method = r->send_method;
+    rule->ignore_whitelist = r->ignore_whitelist;
+    rule->redirect_question = r->redirect_question;
+
+    if (image_load_tree(img, rule, r->src_addrs, RULE_MATCH_SRCADDR) == -1 ||
+        image_load_tree(img, rule, r->dst_addrs, RULE_MATCH_DSTADDR) == -1 ||
+        image_load_flow(img, rule, r->flow) == -1 ||
+        image_load_strings(img, rule, r->strings) == -1)
+        return NULL;
+
+    return rule;
+}
+
+static int
+image_validate(filter_image_t * img, apr_size_t size)
+{
+    const filter_image_hdr_t *hdr = img->hdr;
+
+    if (size < sizeof(*hdr) ||
+        memcmp(hdr->magic, FILTER_IMAGE_MAGIC, sizeof(hdr->magic))) {
+        PRINT_DEBUG("not a filter image\n");
+        return -1;
+    }
+
+    if (hdr->version != FILTER_IMAGE_VERSION) {
+        PRINT_DEBUG("image version %u, expected %u\n", hdr->version,
+                    FILTER_IMAGE_VERSION);
+        return -1;
+    }
+
+    if (hdr->byte_order != FILTER_IMAGE_BYTE_ORDER) {
+        PRINT_DEBUG("image was compiled on a host of different byte order\n");
+        return -1;
+    }
+
+    if (hdr->size != size || hdr->rule_count >= FILTER_IMAGE_NULL)
+        return -1;
+
+    if (!IMAGE_TABLE_OK(hdr, hdr->rules,
+                        (uint64_t) hdr->rule_count + hdr->has_whitelist,
+                        filter_image_rule_t) ||
+        !IMAGE_TABLE_OK(hdr, hdr->prefixes, hdr->prefix_count,
+                        filter_image_prefix_t) ||
+        !IMAGE_TABLE_OK(hdr, hdr->flows, hdr->flow_count,
+                        filter_image_flow_t) ||
+        !IMAGE_TABLE_OK(hdr, hdr->values, hdr->value_count,
+                        filter_image_value_t) ||
+        !IMAGE_TABLE_OK(hdr, hdr->strings, hdr->strings_size, char))
+        return -1;
+
+    if ((hdr->rules | hdr->prefixes | hdr->flows | hdr->values) % 4)
+        return -1;
+
+    /*
+     * with a terminated string table any offset within it is a string
+     */
+    if (hdr->strings_size &&
+        img->base[hdr->strings + hdr->strings_size - 1] != '\0')
+        return -1;
+
+    return 0;
+}
+
+filter_t       *
+filter_image_load(apr_pool_t * pool, const char *filename)
+{
+    /*
+     * names, string values and flow keys point straight into the
+     * mapping, which lives as long as the filter's pool. Only the trees,
+     * the hashes and the compiled regexes are built at load time.
+     */
+    filter_t       *filter;
+    filter_image_t  img;
+    filter_rule_t **rules;
+    const filter_image_rule_t *r;
+    apr_file_t     *fd;
+    apr_finfo_t     finfo;
+    apr_mmap_t     *mm;
+    apr_status_t    rv;
+    uint32_t        i,
+                    n;
+
+    filter = filter_init(pool);
+
+    if (apr_file_open(&fd, filename, APR_READ | APR_BINARY,
+                      APR_OS_DEFAULT, filter->pool) != APR_SUCCESS)
+        goto fail;
+
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fd);
+
+    if (rv == APR_SUCCESS && finfo.size >= (apr_off_t) sizeof(filter_image_hdr_t))
+        rv = apr_mmap_create(&mm, fd, 0, (apr_size_t) finfo.size,
+                             APR_MMAP_READ, filter->pool);
+    else
+        rv = APR_EGENERAL;
+
+    /*
+     * the mapping stays valid after the descriptor is gone
+     */
+    apr_file_close(fd);
+
+    if (rv != APR_SUCCESS)
+        goto fail;
+
+    img.base = mm->mm;
+    img.hdr = (const filter_image_hdr_t *) mm->mm;
+
+    if (image_validate(&img, mm->size) == -1)
+        goto fail;
+
+    n = img.hdr->rule_count + (img.hdr->has_whitelist ? 1 : 0);
+    r = (const filter_image_rule_t *) (img.base + img.hdr->rules);
+    rules = apr_pcalloc(filter->pool, (n ? n : 1) * sizeof(*rules));
+
+    for (i = 0; i < n; i++) {
+        if (!(rules[i] = image_load_rule(&img, filter, &r[i]))) {
+            PRINT_DEBUG("rule %u of image %s is corrupt\n", i, filename);
+            goto fail;
+        }
+
+        if (i < img.hdr->rule_count)
+            filter_add_rule(filter, rules[i]);
+        else
+            filter->whitelist_rule = rules[i];
+    }
+
+    /*
+     * update-rules can only refer to rules in the list proper
+     */
+    for (i = 0; i < n; i++) {
+        if (r[i].update_rule == FILTER_IMAGE_NULL)
+            continue;
+
+        if (r[i].update_rule >= img.hdr->rule_count ||
+            filter_rule_set_update_rule(filter, rules[i],
+                                        rules[r[i].update_rule]) == -1)
+            goto fail;
+    }
+
+    if (filter_index_build(filter) == -1)
+        goto fail;
+
+    return filter;
+
+  fail:
+    apr_pool_destroy(filter->pool);
+    return NULL;
+}
@@ -0,0 +1,115 @@
+/******************************************************************************/
+/* filter_image.h  -- precompiled filter images
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#ifndef _FILTER_IMAGE_H
+#define _FILTER_IMAGE_H
+
+#include "filter.h"
+
+/*
+ * A filter image is a filter (rules, whitelist, addresses, strings and
+ * flows) flattened into a single file by webfw2c. Nothing in it is a
+ * pointer: every reference is an offset from the start of the image or
+ * an index into one of its tables, so it can be mapped anywhere and is
+ * loaded without going through libconfuse or parsing a single address.
+ *
+ *   header | rules | prefixes | flows | values | string table
+ *
+ * Images are written in host byte order and are refused by a host with
+ * a different one, recompile them where they are going to be used.
+ */
+
+#define FILTER_IMAGE_MAGIC       "WF2C"
+#define FILTER_IMAGE_VERSION     3
+#define FILTER_IMAGE_BYTE_ORDER  0x01020304
+#define FILTER_IMAGE_NULL        0xffffffff
+
+typedef struct filter_image_hdr {
+    char            magic[4];
+    uint32_t        version;
+    uint32_t        byte_order;
+    uint32_t        size;
+    /*
+     * rule_count does not include the whitelist rule, which, when
+     * has_whitelist is set, is stored as the very last rule.
+     */
+    uint32_t        rule_count;
+    uint32_t        has_whitelist;
+    uint32_t        rules;
+    uint32_t        prefixes;
+    uint32_t        prefix_count;
+    uint32_t        flows;
+    uint32_t        flow_count;
+    uint32_t        values;
+    uint32_t        value_count;
+    uint32_t        strings;
+    uint32_t        strings_size;
+} filter_image_hdr_t;
+
+/*
+ * a contiguous range within one of the tables
+ */
+typedef struct filter_image_range {
+    uint32_t        first;
+    uint32_t        count;
+} filter_image_range_t;
+
+typedef struct filter_image_rule {
+    uint32_t        name;
+    uint32_t        redirect_url;
+    int32_t         action;
+    int32_t         status_code;
+    uint8_t         log;
+    uint8_t         send_method;
+    uint8_t         ignore_whitelist;
+    uint8_t         redirect_question;
+    /*
+     * index of the update-rule, FILTER_IMAGE_NULL if there is none
+     */
+    uint32_t        update_rule;
+    filter_image_range_t src_addrs;
+    filter_image_range_t dst_addrs;
+    filter_image_range_t flow;
+    filter_image_range_t strings;
+} filter_image_rule_t;
+
+/*
+ * prefixes of a tree are stored in the order a walk of the tree visits
+ * them. The family is 4 or 6 rather than an AF_ constant, those differ
+ * between platforms.
+ */
+typedef struct filter_image_prefix {
+    uint8_t         family;
+    uint8_t         sub;
+    uint16_t        bitlen;
+    uint8_t         addr[16];
+} filter_image_prefix_t;
+
+/*
+ * a compiled flow term, on_true and on_false are relative to the first
+ * term of the rule's flow, just like in rule_flow_t.
+ */
+typedef struct filter_image_flow {
+    int32_t         type;
+    int32_t         on_true;
+    int32_t         on_false;
+    uint32_t        user_data;
+} filter_image_flow_t;
+
+/*
+ * type is one of the FILTER_STRING_ types
+ */
+typedef struct filter_image_value {
+    uint32_t        key;
+    uint32_t        value;
+    uint32_t        type;
+} filter_image_value_t;
+
+int filter_image_probe(const char *);
+int filter_image_write(apr_pool_t *, filter_t *, const char *);
+filter_t *filter_image_load(apr_pool_t *, const char *);
+
+#endif                          /* _FILTER_IMAGE_H */
@@ -0,0 +1,666 @@
+/******************************************************************************/
+/* filter_index.c  -- indexes over all the rules of a filter
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter_index.h"
+
+/*
+ * merge a rule's tree into index, which is built from tpool. What the
+ * index ends up holding for each prefix is allocated from pool.
+ */
+static int
+index_add_tree(apr_pool_t * pool, apr_pool_t * tpool,
+               patricia_tree_t * index, patricia_tree_t * tree, uint32_t id)
+{
+    patricia_node_t *node;
+    patricia_node_t *inode;
+    prefix_t       *prefix;
+
+    if (!tree)
+        return 0;
+
+    PATRICIA_WALK(tree->head, node) {
+        apr_array_header_t *ids;
+
+        /*
+         * the prefix belongs to the rule's tree, the index gets its own
+         * copy.
+         */
+        prefix = New_Prefix(tpool, node->prefix->family,
+                            &node->prefix->add, node->prefix->bitlen);
+
+        if (!prefix)
+            return -1;
+
+        inode = patricia_lookup(tpool, index, prefix);
+        Deref_Prefix(prefix);
+
+        if (!inode)
+            return -1;
+
+        if (!(ids = inode->data)) {
+            ids = apr_array_make(pool, 1, sizeof(uint32_t));
+            inode->data = ids;
+        }
+
+        *(uint32_t *) apr_array_push(ids) =
+            (id << 1) | (node->data == FILTER_RULE_IP_SUB);
+    } PATRICIA_WALK_END;
+
+    return 0;
+}
+
+/*
+ * the terms of a rule's flow which have to be true for it to accept, as
+ * a bitmap over the terms. Jumps only go forward so this is one pass
+ * from the end: a term is needed if it is needed on both of its branches,
+ * or it is the term itself on its true branch. Rejecting needs everything.
+ */
+static uint32_t *
+index_needed_terms(apr_pool_t * pool, filter_rule_t * rule)
+{
+    uint32_t       *need;
+    uint32_t       *none;
+    uint32_t       *all;
+    int             words,
+                    pc,
+                    w;
+
+    words = FILTER_INDEX_WORDS(rule->flow_len);
+    need = apr_palloc(pool, words * 4 * rule->flow_len);
+    none = apr_pcalloc(pool, words * 4);
+    all = apr_palloc(pool, words * 4);
+    memset(all, 0xff, words * 4);
+
+#define NEEDED(t) ((t) == FILTER_FLOW_ACCEPT ? none : \
+                   (t) == FILTER_FLOW_REJECT ? all : &need[(t) * words])
+
+    for (pc = rule->flow_len - 1; pc >= 0; pc--) {
+        rule_flow_t    *flow = &rule->flow[pc];
+        uint32_t       *on_true = NEEDED(flow->on_true);
+        uint32_t       *on_false = NEEDED(flow->on_false);
+
+        for (w = 0; w < words; w++)
+            need[pc * words + w] = on_true[w] & on_false[w];
+
+        need[pc * words + (pc >> 5)] |= (1U << (pc & 31)) &
+            on_false[pc >> 5];
+    }
+
+#undef NEEDED
+
+    return need;
+}
+
+static void
+index_anchor_string(filter_index_t * index, apr_pool_t * pool,
+                    apr_hash_t * anchors, rule_flow_t * flow, uint32_t id)
+{
+    filter_index_anchor_t *anchor;
+
+    if (!(anchor = apr_hash_get(anchors, flow->user_data,
+                                APR_HASH_KEY_STRING))) {
+        anchor = apr_pcalloc(pool, sizeof(filter_index_anchor_t));
+        anchor->flow = flow;
+        anchor->anchored = apr_pcalloc(pool,
+                                       FILTER_INDEX_WORDS(index->nrules) * 4);
+
+        apr_hash_set(anchors, flow->user_data, APR_HASH_KEY_STRING,
+                     anchor);
+        *(filter_index_anchor_t **) apr_array_push(index->anchors) =
+            anchor;
+    }
+
+    /*
+     * a rule without the group can not match the term at all, its group
+     * never is hit.
+     */
+    FILTER_INDEX_SET(anchor->anchored, id);
+}
+
+/*
+ * the key matcher of a key being built, with its values gathered in a
+ * hash until they all are known
+ */
+typedef struct index_key_build {
+    filter_index_key_t *key;
+    apr_hash_t     *values;
+} index_key_build_t;
+
+static void
+index_add_strings(filter_index_t * index, apr_pool_t * pool,
+                  apr_hash_t * keys, filter_rule_t * rule)
+{
+    apr_hash_index_t *hi,
+                   *vi;
+
+    for (hi = rule->strings ? apr_hash_first(NULL, rule->strings) : NULL;
+         hi; hi = apr_hash_next(hi)) {
+        index_key_build_t *kb;
+        const void     *name;
+        void           *group;
+
+        apr_hash_this(hi, &name, NULL, &group);
+
+        if (!(kb = apr_hash_get(keys, name, APR_HASH_KEY_STRING))) {
+            apr_pool_t     *tpool = apr_hash_pool_get(keys);
+
+            kb = apr_palloc(tpool, sizeof(index_key_build_t));
+            kb->key = apr_pcalloc(pool, sizeof(filter_index_key_t));
+            kb->values = apr_hash_make(tpool);
+
+            apr_hash_set(keys, name, APR_HASH_KEY_STRING, kb);
+            apr_hash_set(index->keys, name, APR_HASH_KEY_STRING, kb->key);
+        }
+
+        for (vi = apr_hash_first(NULL, group); vi; vi = apr_hash_next(vi)) {
+            apr_array_header_t *ids;
+            const void     *value;
+            void           *data;
+            int             i;
+
+            apr_hash_this(vi, &value, NULL, &data);
+
+            if (!strcmp(value, FIXED_KEY)) {
+                apr_array_header_t *fixed = data;
+
+                if (!kb->key->fixed)
+                    kb->key->fixed = strmatch_make(pool);
+
+                for (i = 0; i < fixed->nelts; i++) {
+                    filter_fixed_t *f = &((filter_fixed_t *) fixed->elts)[i];
+
+                    strmatch_add(kb->key->fixed, f->string,
+                                 f->type == FILTER_STRING_PREFIX ?
+                                 STRMATCH_PREFIX :
+                                 f->type == FILTER_STRING_SUFFIX ?
+                                 STRMATCH_SUFFIX : STRMATCH_CONTAINS,
+                                 rule->id);
+                }
+
+                continue;
+            }
+
+            if (!strcmp(value, REGEX_KEY)) {
+                apr_array_header_t *regexes = data;
+
+                if (regexes->nelts && !kb->key->regexes)
+                    kb->key->regexes = regset_make(pool);
+
+                for (i = 0; i < regexes->nelts; i++) {
+                    filter_regex_t *regex =
+                        ((filter_regex_t **) regexes->elts)[i];
+
+                    regset_add(kb->key->regexes, regex->pattern,
+                               &regex->regex, regex->literal, rule->id);
+                }
+
+                continue;
+            }
+
+            if (!(ids = apr_hash_get(kb->values, value,
+                                     APR_HASH_KEY_STRING))) {
+                ids = apr_array_make(pool, 1, sizeof(uint32_t));
+                apr_hash_set(kb->values, value, APR_HASH_KEY_STRING, ids);
+            }
+
+            *(uint32_t *) apr_array_push(ids) = rule->id;
+        }
+    }
+}
+
+static int
+index_finish_keys(apr_pool_t * pool, apr_hash_t * keys)
+{
+    apr_hash_index_t *hi,
+                   *vi;
+
+    for (hi = apr_hash_first(NULL, keys); hi; hi = apr_hash_next(hi)) {
+        index_key_build_t *kb;
+
+        apr_hash_this(hi, NULL, NULL, (void **) &kb);
+
+        if (apr_hash_count(kb->values)) {
+            kb->key->values = strset_make(pool,
+                                          apr_hash_count(kb->values));
+
+            for (vi = apr_hash_first(NULL, kb->values); vi;
+                 vi = apr_hash_next(vi)) {
+                const void     *value;
+                void           *ids;
+
+                apr_hash_this(vi, &value, NULL, &ids);
+                strset_add(kb->key->values, value, ids);
+            }
+        }
+
+        if (kb->key->fixed && strmatch_finish(kb->key->fixed) == -1)
+            return -1;
+
+        if (kb->key->regexes && regset_finish(kb->key->regexes) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+index_anchor_rule(filter_index_t * index, apr_pool_t * pool,
+                  apr_pool_t * tpool, apr_hash_t * anchors,
+                  filter_rule_t * rule)
+{
+    uint32_t       *need;
+    uint32_t       *addr_anchored = NULL;
+    int             pc;
+
+    if (!rule->flow) {
+        /*
+         * a rule without a flow never matches 
+         */
+        return;
+    }
+
+    need = index_needed_terms(tpool, rule);
+
+    for (pc = 0; pc < rule->flow_len; pc++) {
+        rule_flow_t    *flow = &rule->flow[pc];
+        apr_hash_t     *values;
+        apr_array_header_t *regexes;
+
+        if (!FILTER_INDEX_TEST(need, pc))
+            continue;
+
+        switch (flow->type) {
+        case RULE_MATCH_STRING:
+            /*
+             * without any strings the term always matches, and with
+             * fixed strings or regexes in the group the value alone
+             * does not say. An empty array of regexes (they were all
+             * lowered to values, or did not compile) never matches.
+             */
+            if (!rule->strings || !flow->user_data)
+                break;
+
+            values = apr_hash_get(rule->strings, flow->user_data,
+                                  APR_HASH_KEY_STRING);
+
+            regexes = values ? apr_hash_get(values, REGEX_KEY,
+                                            APR_HASH_KEY_STRING) : NULL;
+
+            if ((regexes && regexes->nelts) ||
+                (values && apr_hash_get(values, FIXED_KEY,
+                                        APR_HASH_KEY_STRING)))
+                break;
+
+            index_anchor_string(index, pool, anchors, flow, rule->id);
+            return;
+        case RULE_MATCH_SRCADDR:
+            if (!addr_anchored && rule->src_addrs && !rule->dynamic)
+                addr_anchored = index->src_anchored;
+            break;
+        case RULE_MATCH_DSTADDR:
+            if (!addr_anchored && rule->dst_addrs)
+                addr_anchored = index->dst_anchored;
+            break;
+        }
+    }
+
+    if (addr_anchored) {
+        FILTER_INDEX_SET(addr_anchored, rule->id);
+
+        if (addr_anchored == index->src_anchored)
+            index->src_anchors++;
+        else
+            index->dst_anchors++;
+    } else
+        FILTER_INDEX_SET(index->always, rule->id);
+}
+
+/*
+ * the kind of term flow is at its position of the shape, made if there is
+ * none yet
+ */
+static filter_index_kind_t *
+index_shape_kind(filter_index_t * index, apr_pool_t * pool,
+                 filter_index_shape_t * shape, int pc, rule_flow_t * flow)
+{
+    apr_array_header_t *kinds = shape->kinds[pc];
+    filter_index_kind_t *kind;
+    apr_size_t      size = FILTER_INDEX_WORDS(index->nrules) * 4;
+    int             i;
+
+    for (i = 0; i < kinds->nelts; i++) {
+        kind = &((filter_index_kind_t *) kinds->elts)[i];
+
+        if (kind->flow->type == flow->type &&
+            (!flow->user_data ||
+             !strcmp(kind->flow->user_data, flow->user_data)))
+            return kind;
+    }
+
+    kind = apr_array_push(kinds);
+    kind->flow = flow;
+    kind->rules = apr_pcalloc(pool, size);
+    kind->always = apr_pcalloc(pool, size);
+    kind->cond = apr_pcalloc(pool, size);
+
+    return kind;
+}
+
+static void
+index_add_shape(filter_index_t * index, apr_pool_t * pool,
+                apr_hash_t * shapes, filter_rule_t * rule)
+{
+    filter_index_shape_t *shape;
+    apr_pool_t     *tpool = apr_hash_pool_get(shapes);
+    int            *jumps,
+                    pc;
+    uint32_t        w = rule->id >> 5;
+
+    /*
+     * a rule whose source addresses an update-rule adds to is matched on
+     * its own, the index does not have them
+     */
+    if (rule->dynamic) {
+        FILTER_INDEX_SET(index->slow, rule->id);
+        return;
+    }
+
+    jumps = apr_palloc(tpool, sizeof(int) * 2 * rule->flow_len);
+
+    for (pc = 0; pc < rule->flow_len; pc++) {
+        jumps[pc * 2] = rule->flow[pc].on_true;
+        jumps[pc * 2 + 1] = rule->flow[pc].on_false;
+    }
+
+    if (!(shape = apr_hash_get(shapes, jumps,
+                               sizeof(int) * 2 * rule->flow_len))) {
+        shape = apr_pcalloc(pool, sizeof(filter_index_shape_t));
+        shape->flow = rule->flow;
+        shape->len = rule->flow_len;
+        shape->rules = apr_pcalloc(pool,
+                                   FILTER_INDEX_WORDS(index->nrules) * 4);
+        shape->lo = w;
+        shape->kinds = apr_pcalloc(pool, sizeof(apr_array_header_t *) *
+                                   rule->flow_len);
+
+        for (pc = 0; pc < rule->flow_len; pc++)
+            shape->kinds[pc] = apr_array_make(pool, 1,
+                                              sizeof(filter_index_kind_t));
+
+        apr_hash_set(shapes, jumps, sizeof(int) * 2 * rule->flow_len,
+                     shape);
+        *(filter_index_shape_t **) apr_array_push(index->shapes) = shape;
+
+        if (rule->flow_len > index->max_len)
+            index->max_len = rule->flow_len;
+    }
+
+    FILTER_INDEX_SET(shape->rules, rule->id);
+    shape->hi = w + 1;
+
+    for (pc = 0; pc < rule->flow_len; pc++) {
+        rule_flow_t    *flow = &rule->flow[pc];
+        filter_index_kind_t *kind;
+        apr_hash_t     *group = NULL;
+        int             always = 0,
+                        cond = 0;
+
+        kind = index_shape_kind(index, pool, shape, pc, flow);
+
+        if (rule->strings && flow->user_data)
+            group = apr_hash_get(rule->strings, flow->user_data,
+                                 APR_HASH_KEY_STRING);
+
+        switch (flow->type) {
+        case RULE_MATCH_SRCADDR:
+            always = !rule->src_addrs;
+            break;
+        case RULE_MATCH_DSTADDR:
+            always = !rule->dst_addrs;
+            break;
+        case RULE_MATCH_STRING:
+            always = !rule->strings;
+            break;
+        case RULE_MATCH_NOT_STRING:
+            /*
+             * a group with neither fixed strings nor regexes in a rule
+             * with some elsewhere never matches
+             */
+            always = !rule->strings;
+            cond = group && (!rule->strings_have_regex ||
+                             apr_hash_get(group, FIXED_KEY,
+                                          APR_HASH_KEY_STRING) ||
+                             apr_hash_get(group, REGEX_KEY,
+                                          APR_HASH_KEY_STRING));
+            break;
+        }
+
+        FILTER_INDEX_SET(kind->rules, rule->id);
+
+        if (always)
+            FILTER_INDEX_SET(kind->always, rule->id);
+
+        if (cond)
+            FILTER_INDEX_SET(kind->cond, rule->id);
+    }
+}
+
+/*
+ * number the rules (the whitelist rule last), merge their address trees
+ * and string groups, anchor them and sort them by shape. Only the trees built at load time are indexed,
+ * addresses added by an update-rule are still searched in the rule's own
+ * dynamic tree.
+ */
+int
+filter_index_build(filter_t * filter)
+{
+    filter_index_t *index;
+    filter_rule_t  *rule;
+    apr_pool_t     *tpool;
+    apr_pool_t     *rpool;
+    apr_hash_t     *anchors;
+    apr_hash_t     *keys;
+    apr_hash_t     *shapes;
+    patricia_tree_t *src_addrs;
+    patricia_tree_t *dst_addrs;
+    uint32_t        id;
+    apr_size_t      size;
+
+    index = apr_pcalloc(filter->pool, sizeof(filter_index_t));
+    index->anchors = apr_array_make(filter->pool, 4,
+                                    sizeof(filter_index_anchor_t *));
+    index->keys = apr_hash_make(filter->pool);
+    index->facts = apr_array_make(filter->pool, 4,
+                                  sizeof(filter_index_key_t *));
+    index->shapes = apr_array_make(filter->pool, 4,
+                                   sizeof(filter_index_shape_t *));
+
+    index->nlisted = filter->rule_count;
+    index->nrules = index->nlisted + (filter->whitelist_rule ? 1 : 0);
+    index->rules = apr_pcalloc(filter->pool,
+                               (index->nrules + 1) * sizeof(filter_rule_t *));
+
+    for (id = 0, rule = filter->head; rule && id < index->nlisted;
+         rule = rule->next)
+        index->rules[id++] = rule;
+
+    if (rule || id != index->nlisted)
+        return -1;
+
+    if (filter->whitelist_rule)
+        index->rules[id++] = filter->whitelist_rule;
+
+    index->ignoring = apr_palloc(filter->pool,
+                                 (index->nlisted + 1) * sizeof(uint32_t));
+
+    for (id = 0; id < index->nlisted; id++)
+        if (index->rules[id]->ignore_whitelist)
+            index->ignoring[index->nignoring++] = id;
+
+    size = FILTER_INDEX_WORDS(index->nrules) * 4;
+    index->always = apr_pcalloc(filter->pool, size);
+    index->src_anchored = apr_pcalloc(filter->pool, size);
+    index->dst_anchored = apr_pcalloc(filter->pool, size);
+    index->slow = apr_pcalloc(filter->pool, size);
+
+    apr_pool_create(&tpool, filter->pool);
+    apr_pool_create(&rpool, tpool);
+    anchors = apr_hash_make(tpool);
+    keys = apr_hash_make(tpool);
+    shapes = apr_hash_make(tpool);
+    src_addrs = New_Patricia(tpool, 128);
+    dst_addrs = New_Patricia(tpool, 128);
+
+    for (id = 0; id < index->nrules; id++) {
+        rule = index->rules[id];
+        rule->id = id;
+
+        if (index_add_tree(filter->pool, tpool, src_addrs,
+                           rule->src_addrs, id) == -1 ||
+            index_add_tree(filter->pool, tpool, dst_addrs,
+                           rule->dst_addrs, id) == -1) {
+            apr_pool_destroy(tpool);
+            return -1;
+        }
+
+        index_anchor_rule(index, filter->pool, rpool, anchors, rule);
+        index_add_strings(index, filter->pool, keys, rule);
+
+        if (rule->flow)
+            index_add_shape(index, filter->pool, shapes, rule);
+        apr_pool_clear(rpool);
+    }
+
+    if (index_finish_keys(filter->pool, keys) == -1) {
+        apr_pool_destroy(tpool);
+        return -1;
+    }
+
+    index->src_addrs = patricia_freeze(filter->pool, src_addrs);
+    index->dst_addrs = patricia_freeze(filter->pool, dst_addrs);
+
+    apr_pool_destroy(tpool);
+
+    filter->index = index;
+    return 0;
+}
+
+/*
+ * look IPv4 addresses up in flat tables (see patricia_frozen_tabulate())
+ * in the merged trees with at least threshold prefixes of up to 32 bits,
+ * 0 for none. Returns how many tables were made.
+ */
+int
+filter_index_tabulate(filter_t * filter, u_int threshold)
+{
+    filter_index_t *index = filter->index;
+    int             made = 0;
+
+    if (!index || !threshold)
+        return 0;
+
+    made += patricia_frozen_tabulate(filter->pool, index->src_addrs,
+                                     threshold);
+    made += patricia_frozen_tabulate(filter->pool, index->dst_addrs,
+                                     threshold);
+
+    return made;
+}
+
+/*
+ * fill in which rules' trees hold the address as a '+' and which as a '-'
+ * prefix, rules in neither do not have it at all.
+ */
+void
+filter_index_lookup(filter_index_t * index, int fact, filter_addr_t * addr)
+{
+    void           *found[PATRICIA_MAXBITS + 1];
+    patricia_frozen_t *tree;
+    int             n,
+                    i,
+                    j;
+
+    memset(addr->add, 0, FILTER_INDEX_WORDS(index->nrules) * 4);
+    memset(addr->sub, 0, FILTER_INDEX_WORDS(index->nrules) * 4);
+
+    tree = fact == FILTER_FACT_SRCADDR ? index->src_addrs : index->dst_addrs;
+    n = patricia_frozen_search_all(tree, addr->addr, addr->bitlen, found);
+
+    for (i = 0; i < n; i++) {
+        apr_array_header_t *ids = found[i];
+
+        for (j = 0; j < ids->nelts; j++) {
+            uint32_t        entry = ((uint32_t *) ids->elts)[j];
+            uint32_t        id = entry >> 1;
+
+            /*
+             * a longer prefix already decided for this rule
+             */
+            if (FILTER_INDEX_TEST(addr->add, id) ||
+                FILTER_INDEX_TEST(addr->sub, id))
+                continue;
+
+            if (entry & 1)
+                FILTER_INDEX_SET(addr->sub, id);
+            else
+                FILTER_INDEX_SET(addr->add, id);
+        }
+    }
+}
+
+/*
+ * the string terms on key fetch their data as fact, see
+ * filter_register_user_cb()
+ */
+void
+filter_index_bind(filter_index_t * index, const char *key, int fact)
+{
+    filter_index_key_t *k = apr_hash_get(index->keys, key,
+                                         APR_HASH_KEY_STRING);
+
+    while (index->facts->nelts <= fact)
+        *(filter_index_key_t **) apr_array_push(index->facts) = NULL;
+
+    ((filter_index_key_t **) index->facts->elts)[fact] = k;
+}
+
+/*
+ * fill in which rules' groups for the key of the fact the string hits,
+ * each matcher of the key being run over it once for all of them.
+ */
+void
+filter_index_match(filter_index_t * index, int fact, filter_string_t * str,
+                   apr_pool_t * pool)
+{
+    filter_index_key_t *key = NULL;
+    apr_array_header_t *ids;
+    int                 i;
+
+    memset(str->hits, 0, FILTER_INDEX_WORDS(index->nrules) * 4);
+
+    if (fact < index->facts->nelts)
+        key = ((filter_index_key_t **) index->facts->elts)[fact];
+
+    if (!key)
+        return;
+
+    if (key->values && (ids = strset_get(key->values, &str->key)))
+        for (i = 0; i < ids->nelts; i++)
+            FILTER_INDEX_SET(str->hits, ((uint32_t *) ids->elts)[i]);
+
+    if (key->fixed)
+        strmatch_match_all(key->fixed, str->key.str, str->hits);
+
+    /*
+     * last, so that the regexes left to regexec() are skipped for the
+     * rules already hit
+     */
+    if (key->regexes)
+        regset_match_all(key->regexes, str->key.str, pool, str->hits);
+}
@@ -0,0 +1,149 @@
+/******************************************************************************/
+/* filter_index.h  -- indexes over all the rules of a filter
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#ifndef _FILTER_INDEX_H
+#define _FILTER_INDEX_H
+
+#include "filter.h"
+
+/*
+ * the address trees of all rules merged into one tree per direction.
+ * Every prefix in there carries an array of the rules listing it, each
+ * entry being (rule->id << 1) | sub, sub set for a '-' prefixed address.
+ * The rules of one prefix are in id order.
+ *
+ * A single descent for an address then yields every prefix holding it,
+ * the first one found for a rule (the longest) being the one that rule's
+ * own tree would have matched.
+ */
+/*
+ * The candidate index. A term the flow of a rule can not accept without
+ * (a necessary condition) which can be answered for all rules at once is
+ * the rule's anchor:
+ *
+ *   match_string(key) on a group without regexes: the rule is only a
+ *     candidate when the request's value for key is one of the group's,
+ *     that is when the key's matcher says the value hits the group.
+ *   match_src_addrs / match_dst_addrs on a rule with a load-time tree
+ *     (and no update-rule tree): only when the address index holds the
+ *     address as a '+' prefix of the rule.
+ *
+ * Rules without an anchor are always candidates.
+ */
+typedef struct filter_index_anchor {
+    /*
+     * one of the terms on the key, the data is fetched the way it does
+     */
+    rule_flow_t        *flow;
+    /*
+     * the ids of the rules anchored on the key
+     */
+    uint32_t           *anchored;
+} filter_index_anchor_t;
+
+/*
+ * the groups of all the rules for one string key, merged into a matcher
+ * of each kind: a set of all the values (value -> array of the ids of
+ * the rules having it), an automaton of all the fixed strings and one of
+ * all the regexes, the latter two reporting the rule ids they were added
+ * with. A value is run through each of them once to find every rule
+ * whose group it hits, however many rules have a group for the key.
+ */
+typedef struct filter_index_key {
+    strset_t           *values;
+    strmatch_t         *fixed;
+    regset_t           *regexes;
+} filter_index_key_t;
+
+/*
+ * For evaluating every rule at once (filter_t's bitset_eval), rules are
+ * grouped by the shape of their compiled flow: its length and where each
+ * term jumps. The rules of a shape run its program together, a bit per
+ * rule: each term position holds the kinds of term found there (type and
+ * key), and the result of a kind for all rules comes straight from the
+ * fact, whose bitmaps (filter_addr_t's add, filter_string_t's hits) say
+ * it per rule. always and cond are the rules of the kind for which the
+ * result does not depend on the fact or does, see
+ * filter_request_evaluate().
+ */
+typedef struct filter_index_kind {
+    rule_flow_t        *flow;
+    uint32_t           *rules;
+    uint32_t           *always;
+    uint32_t           *cond;
+} filter_index_kind_t;
+
+typedef struct filter_index_shape {
+    /*
+     * the flow of the first rule of the shape, for its jumps
+     */
+    rule_flow_t        *flow;
+    int                 len;
+    uint32_t           *rules;
+    /*
+     * the words of the bitmaps the rules of the shape are in
+     */
+    uint32_t            lo;
+    uint32_t            hi;
+    /*
+     * an array of filter_index_kind_t per term
+     */
+    apr_array_header_t **kinds;
+} filter_index_shape_t;
+
+struct filter_index {
+    uint32_t            nrules;
+    /*
+     * rules by id, the ones in the filter's list come first and the
+     * whitelist rule, if there is one, last.
+     */
+    filter_rule_t     **rules;
+    uint32_t            nlisted;
+    /*
+     * the ids of the rules of the list with ignore_whitelist set, in
+     * order: all a whitelisted request is traversed through
+     */
+    uint32_t           *ignoring;
+    uint32_t            nignoring;
+    /*
+     * every rule's load-time address trees merged, frozen once built
+     */
+    patricia_frozen_t  *src_addrs;
+    patricia_frozen_t  *dst_addrs;
+    uint32_t           *always;
+    uint32_t           *src_anchored;
+    uint32_t           *dst_anchored;
+    uint32_t            src_anchors;
+    uint32_t            dst_anchors;
+    apr_array_header_t *anchors;
+    /*
+     * key -> its filter_index_key_t, and the same by fact id for the
+     * keys a callback is registered for
+     */
+    apr_hash_t         *keys;
+    apr_array_header_t *facts;
+    /*
+     * the shapes of all rules' flows, the longest of them, and the rules
+     * which have to be matched on their own (their source addresses may
+     * change under an update-rule)
+     */
+    apr_array_header_t *shapes;
+    int                 max_len;
+    uint32_t           *slow;
+};
+
+#define FILTER_INDEX_WORDS(n)      (((n) + 31) / 32)
+#define FILTER_INDEX_SET(bits, id) ((bits)[(id) >> 5] |= 1U << ((id) & 31))
+#define FILTER_INDEX_TEST(bits, id) ((bits)[(id) >> 5] & (1U << ((id) & 31)))
+
+int filter_index_build(filter_t *);
+int filter_index_tabulate(filter_t *, u_int);
+void filter_index_lookup(filter_index_t *, int, filter_addr_t *);
+void filter_index_bind(filter_index_t *, const char *, int);
+void filter_index_match(filter_index_t *, int, filter_string_t *,
+                        apr_pool_t *);
+
+#endif                          /* _FILTER_INDEX_H */
@@ -23,55 +23,234 @@
 #endif
 #endif
 #include "mod_webfw2.h"
+#include "callbacks.h"
+#include "filter_image.h"
+#include "filter_index.h"
 #include "thrasher.h"
 
 module AP_MODULE_DECLARE_DATA webfw2_module;
 
 static void
-webfw2_filter_parse(apr_pool_t * pool, webfw2_config_t * config,
-                    webfw2_filter_t * filter)
+webfw2_generation_release(webfw2_generation_t * gen)
 {
-    apr_pool_create(&filter->pool, pool);
+    if (!gen)
+        return;
+
+    if (apr_atomic_dec32(&gen->refcount) != 0)
+        return;
+
+    /*
+     * a late reader in webfw2_generation_acquire() may bounce the count
+     * off zero again after we got here, make sure only one of us tears
+     * the ruleset down. A generation inherited from the parent has no
+     * pool of its own, its memory belongs to the parent's pconf, only
+     * what its update-rules added in this child is freed.
+     */
+    if (apr_atomic_cas32(&gen->reclaimed, 1, 0) != 0)
+        return;
+
+    if (gen->pool)
+        apr_pool_destroy(gen->pool);
+
+    if (gen->dynamic_pool)
+        apr_pool_destroy(gen->dynamic_pool);
+}
+
+static webfw2_generation_t *
+webfw2_generation_acquire(webfw2_filter_t * filter)
+{
+    webfw2_generation_t *gen;
+
+    /*
+     * take a reference and then make sure the generation is still the
+     * published one. If it was swapped out in between, the reference we
+     * took may be on a generation that is already being reclaimed, so
+     * drop it and try again. This is why generation headers are never
+     * freed: a stale pointer is always safe to increment.
+     */
+    for (;;) {
+        if (!(gen = filter->current))
+            return NULL;
+
+        apr_atomic_inc32(&gen->refcount);
+
+        if (gen == filter->current)
+            return gen;
+
+        webfw2_generation_release(gen);
+    }
+}
+
+static void
+webfw2_generation_publish(webfw2_filter_t * filter,
+                          webfw2_generation_t * gen)
+{
+    webfw2_generation_t *old;
+
+    old = apr_atomic_xchgptr((volatile void **) &filter->current, gen);
+
+    /*
+     * drop the reference the old generation held as the published one,
+     * requests still evaluating it keep it alive until they are done.
+     */
+    webfw2_generation_release(old);
+}
+
+static apr_status_t
+webfw2_generation_cleanup(void *data)
+{
+    webfw2_generation_publish((webfw2_filter_t *) data, NULL);
+    return APR_SUCCESS;
+}
+
+static filter_t *
+webfw2_ruleset_build(apr_pool_t * pool, webfw2_config_t * config)
+{
+    filter_t       *filter;
 
     if (!config->config_file) {
         ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
                      "No configuration file specified for webfw2! NO RULES LOADED!");
-        return;
+        return NULL;
     }
 
-    filter->filter =
-        filter_parse_config(filter->pool, config->config_file, 1);
+    /*
+     * webfw2_config may also point at an image compiled by webfw2c
+     */
+    if (filter_image_probe(config->config_file))
+        filter = filter_image_load(pool, config->config_file);
+    else
+        filter = filter_parse_config(pool, config->config_file, 1);
 
-    if (!filter->filter) {
+    if (!filter) {
         ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
                      "webfw2 configuration syntax error! NO RULES LOADED!!!!!");
-        return;
+        return NULL;
     }
 
-    webfw2_register_callbacks(filter->pool, config, filter);
+    if (filter_regexes_lowered(filter))
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+                     "webfw2 matching %u regexes as plain strings",
+                     filter_regexes_lowered(filter));
+
+    if (filter_index_tabulate(filter, config->ipv4_table_threshold))
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
+                     "webfw2 looking up IPv4 addresses in flat tables");
+
+    filter->bitset_eval = config->bitset_eval;
+    webfw2_register_callbacks(pool, config, filter);
+
+    return filter;
+}
+
+static webfw2_generation_t *
+webfw2_generation_alloc(webfw2_filter_t * filter)
+{
+    webfw2_generation_t *gen;
+
+    gen = apr_pcalloc(filter->generations, sizeof(webfw2_generation_t));
+
+    /*
+     * the reference held by filter->current once this is published 
+     */
+    gen->refcount = 1;
+
+    return gen;
+}
+
+static webfw2_generation_t *
+webfw2_generation_create(webfw2_filter_t * filter, webfw2_config_t * config)
+{
+    webfw2_generation_t *gen;
+
+    gen = webfw2_generation_alloc(filter);
+
+    /*
+     * the last request holding a reference may be running in any thread,
+     * so don't hang the ruleset off of a pool some other thread allocates
+     * from.
+     */
+    apr_pool_create(&gen->pool, NULL);
+
+    gen->filter = webfw2_ruleset_build(gen->pool, config);
+
+    return gen;
+}
+
+static webfw2_generation_t *
+webfw2_generation_inherit(webfw2_filter_t * filter,
+                          webfw2_preload_t * preload)
+{
+    webfw2_generation_t *gen;
+
+    /*
+     * only the header (and with it the refcount) lives in child memory,
+     * the ruleset itself is the parent's and is only ever read from here
+     * on. gen->pool stays NULL so that a reload never tries to free it.
+     *
+     * Update-rules and the regex caches do write while serving requests:
+     * they get storage of their own in this child, from the global
+     * allocator which, unlike the preloaded ruleset's, is safe to share
+     * between threads.
+     */
+    gen = webfw2_generation_alloc(filter);
+    gen->filter = preload->filter;
+
+    apr_pool_create(&gen->dynamic_pool, NULL);
+    ap_assert(filter_dynamic_attach(gen->filter,
+                                    gen->dynamic_pool) == 0);
+    ap_assert(filter_regset_attach(gen->filter,
+                                   gen->dynamic_pool) == 0);
+
+    return gen;
 }
 
 static webfw2_filter_t *
-webfw2_filter_init(apr_pool_t * pool, webfw2_config_t * config)
+webfw2_filter_init(apr_pool_t * pool, webfw2_config_t * config,
+                   webfw2_preload_t * preload)
 {
     webfw2_filter_t *filter;
     apr_finfo_t     sb;
 
 
     filter = apr_pcalloc(pool, sizeof(webfw2_filter_t));
-    webfw2_filter_parse(pool, config, filter);
-
-    /*
-     * fetch the current date on the config file 
-     */
-    apr_stat(&sb, config->config_file, APR_FINFO_MTIME, pool);
-    filter->last_modification = sb.mtime;
+    filter->pool = pool;
+    apr_pool_create(&filter->generations, pool);
 
 #ifdef APR_HAS_THREADS
-    ap_assert(apr_thread_rwlock_create(&filter->rwlock, pool) ==
-              APR_SUCCESS);
+    ap_assert(apr_thread_mutex_create(&filter->update_mutex,
+                                      APR_THREAD_MUTEX_DEFAULT,
+                                      pool) == APR_SUCCESS);
+    ap_assert(apr_thread_mutex_create(&filter->thrasher_mutex,
+                                      APR_THREAD_MUTEX_DEFAULT,
+                                      pool) == APR_SUCCESS);
 #endif
 
+    if (preload) {
+        webfw2_generation_publish(filter,
+                                  webfw2_generation_inherit(filter,
+                                                            preload));
+        filter->last_modification = preload->mtime;
+    } else {
+        webfw2_generation_publish(filter,
+                                  webfw2_generation_create(filter,
+                                                           config));
+
+        /*
+         * fetch the current date on the config file 
+         */
+        apr_stat(&sb, config->config_file, APR_FINFO_MTIME, pool);
+        filter->last_modification = sb.mtime;
+    }
+
+    /*
+     * subpools go away before their parent's cleanups run, so hang this off
+     * the pool holding the generation headers. 
+     */
+    apr_pool_cleanup_register(filter->generations, filter,
+                              webfw2_generation_cleanup,
+                              apr_pool_cleanup_null);
+
     if (config->thrasher_host && config->thrasher_port) {
         /*
          * create our thrasher socket 
@@ -107,7 +286,11 @@ webfw2_updater(request_rec * rec)
 
 
 #ifdef APR_HAS_THREADS
-    if (apr_thread_rwlock_trywrlock(wf2_filter->rwlock) != APR_SUCCESS)
+    /*
+     * somebody else is already checking for (or loading) a new ruleset,
+     * requests keep being served from the current one in the meantime. 
+     */
+    if (apr_thread_mutex_trylock(wf2_filter->update_mutex) != APR_SUCCESS)
         return 0;
 #endif
 
@@ -118,7 +301,6 @@ webfw2_updater(request_rec * rec)
          */
         apr_status_t    rv;
         apr_finfo_t     sb;
-        apr_pool_t     *subpool;
 
         if (now - wf2_filter->last_update <= config->update_interval)
             /*
@@ -139,67 +321,230 @@ webfw2_updater(request_rec * rec)
             break;
 
         /*
-         * the file has in-fact changed, lets re-read the config and start
-         * over 
-         */
-
-        /*
-         * this will remove everything in our current filter 
+         * the file has in-fact changed, build a new generation and swap
+         * it in. The old one goes away once the last request using it
+         * has finished.
          */
-        subpool = wf2_filter->pool;
-        apr_pool_destroy(subpool);
-
         ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
                      "Changes found within webfw2 configuration "
                      "reloading rules!");
 
-        webfw2_filter_parse(rec->server->process->pool,
-                            config, wf2_filter);
+        webfw2_generation_publish(wf2_filter,
+                                  webfw2_generation_create(wf2_filter,
+                                                           config));
 
         wf2_filter->last_modification = sb.mtime;
     } while (0);
 
     wf2_filter->last_update = now;
 #ifdef APR_HAS_THREADS
-    apr_thread_rwlock_unlock(wf2_filter->rwlock);
+    apr_thread_mutex_unlock(wf2_filter->update_mutex);
 #endif
     return 0;
 }
 
+static int
+webfw2_post_config(apr_pool_t * pconf, apr_pool_t * plog,
+                   apr_pool_t * ptemp, server_rec * rec)
+{
+    webfw2_config_t *config;
+    webfw2_preload_t *preload;
+    apr_allocator_t *allocator;
+    apr_pool_t     *pool;
+    apr_finfo_t     sb;
+
+    config = ap_get_module_config(rec->module_config, &webfw2_module);
+
+    if (!config)
+        /*
+         * the throw-away first configuration pass, see
+         * webfw2_init_config() 
+         */
+        return OK;
+
+    /*
+     * build the ruleset once, here in the parent, instead of in every
+     * child. It gets an allocator of its own so that it is laid out in
+     * blocks nothing else ever allocates from: once forked, the pages it
+     * sits on are only read, and stay shared between all of the children.
+     * Should any of this fail the children simply parse it themselves.
+     */
+    if (apr_allocator_create(&allocator) != APR_SUCCESS)
+        return OK;
+
+    if (apr_pool_create_ex(&pool, pconf, NULL, allocator) != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return OK;
+    }
+
+    apr_allocator_owner_set(allocator, pool);
+
+    preload = apr_pcalloc(pool, sizeof(webfw2_preload_t));
+
+    if (config->config_file &&
+        apr_stat(&sb, config->config_file, APR_FINFO_MTIME,
+                 ptemp) == APR_SUCCESS)
+        preload->mtime = sb.mtime;
+
+    preload->filter = webfw2_ruleset_build(pool, config);
+
+    if (!preload->filter) {
+        /*
+         * leave no preload behind, the children try for themselves 
+         */
+        apr_pool_destroy(pool);
+        return OK;
+    }
+
+    /*
+     * pconf is cleared on restart, taking the preloaded ruleset with it
+     */
+    apr_pool_userdata_set(preload, FILTER_PRELOAD_KEY,
+                          apr_pool_cleanup_null, pconf);
+
+    return OK;
+}
+
 static void
 webfw2_child_init(apr_pool_t * pool, server_rec * rec)
 {
     webfw2_config_t *config;
     webfw2_filter_t *wf2_filter;
+    webfw2_preload_t *preload = NULL;
 
     config = ap_get_module_config(rec->module_config, &webfw2_module);
     ap_assert(config);
 
+    apr_pool_userdata_get((void **) &preload,
+                          FILTER_PRELOAD_KEY, rec->process->pconf);
+
     /*
      * create a subpool that will be used as the root for our rules and
      * filters, then set it as a server pool key 
      */
 
-    wf2_filter = webfw2_filter_init(pool, config);
+    wf2_filter = webfw2_filter_init(pool, config, preload);
     ap_assert(wf2_filter);
 
     apr_pool_userdata_set(wf2_filter, FILTER_CONFIG_KEY,
                           apr_pool_cleanup_null, rec->process->pool);
 }
 
+/*
+ * an XFF header is split into at most this many entries (as
+ * filter_tokenize_str() did), anything past them is not looked at
+ */
+#define WEBFW2_XFF_MAX_ENTRIES 127
+
+/*
+ * at most this many distinct XFF addresses are kept per request, and
+ * the size (a power of two, at least twice that) of the set they are
+ * told apart with
+ */
+#define WEBFW2_XFF_MAX_SOURCES 128
+#define WEBFW2_XFF_SLOTS       256
+
+typedef struct webfw2_span {
+    const char     *str;
+    apr_size_t      len;
+} webfw2_span_t;
+
+/*
+ * the addresses found for a request, and the IPv4 ones among them in
+ * binary as an open addressing set
+ */
+typedef struct webfw2_sources {
+    apr_array_header_t *addrs;
+    uint32_t        slots[WEBFW2_XFF_SLOTS];
+    uint8_t         used[WEBFW2_XFF_SLOTS];
+    int             count;
+} webfw2_sources_t;
+
+/*
+ * add an address found in a header, copied out of it, unless it is not
+ * a valid IPv4 address or was added already
+ */
+static void
+webfw2_sources_add(apr_pool_t * pool, webfw2_sources_t * sources,
+                   const webfw2_span_t * span)
+{
+    u_char          bytes[4];
+    uint32_t        addr,
+                    i;
+
+    if (!patricia_parse_ipv4(span->str, span->len, bytes, 1))
+        return;
+
+    addr = ((uint32_t) bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) |
+        bytes[3];
+
+    for (i = (addr * 2654435761U) >> 24;
+         sources->used[i]; i = (i + 1) & (WEBFW2_XFF_SLOTS - 1))
+        if (sources->slots[i] == addr)
+            return;
+
+    if (sources->count >= WEBFW2_XFF_MAX_SOURCES)
+        return;
+
+    sources->used[i] = 1;
+    sources->slots[i] = addr;
+    sources->count++;
+
+    *(const char **) apr_array_push(sources->addrs) =
+        apr_pstrmemdup(pool, span->str, span->len);
+}
+
+/*
+ * the connection's own address goes last, whatever it is, unless it was
+ * in a header already
+ */
 static void
-webfw2_add_array_unique(apr_pool_t          *pool, apr_array_header_t  *addr_array, const char *addr)
+webfw2_sources_add_client(apr_pool_t * pool, webfw2_sources_t * sources,
+                          const char *client_ip)
 {
-    int i;
+    int             i;
 
-    for (i = 0; i < addr_array->nelts; i++) {
-        char *src_ip = ((char **) addr_array->elts)[i];
-        if (strcmp(src_ip, addr) == 0)
+    for (i = 0; i < sources->addrs->nelts; i++)
+        if (!strcmp(((char **) sources->addrs->elts)[i], client_ip))
             return;
+
+    *(const char **) apr_array_push(sources->addrs) =
+        apr_pstrdup(pool, client_ip);
+}
+
+/*
+ * split a header in place into its comma separated entries, without the
+ * white space around them. Empty entries are skipped, only the first
+ * WEBFW2_XFF_MAX_ENTRIES are returned.
+ */
+static int
+webfw2_split_xff(const char *value, webfw2_span_t * spans)
+{
+    const char     *p = value;
+    int             nelts = 0;
+
+    while (*p && nelts < WEBFW2_XFF_MAX_ENTRIES) {
+        const char     *start,
+                       *end;
+
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+
+        for (start = p; *p && *p != ','; p++);
+
+        for (end = p; end > start && isspace((unsigned char) end[-1]);
+             end--);
+        while (start < end && isspace((unsigned char) *start))
+            start++;
+
+        spans[nelts].str = start;
+        spans[nelts].len = end - start;
+        nelts++;
     }
 
-    *(const char **) apr_array_push(addr_array) =
-        apr_pstrdup(pool, addr);
+    return nelts;
 }
 
 static apr_array_header_t *
@@ -211,28 +556,33 @@ webfw2_find_all_sources(request_rec * rec)
      * it to an array we can filter on 
      */
     webfw2_config_t *config;
-    apr_array_header_t *addr_array;
+    webfw2_sources_t *sources;
+    webfw2_span_t   spans[WEBFW2_XFF_MAX_ENTRIES];
     apr_table_entry_t *hdrs;
     apr_array_header_t *hdrs_arr;
+    const char     *client_ip;
     int             i;
 
     config =
         ap_get_module_config(rec->server->module_config, &webfw2_module);
     ap_assert(config);
 
-    addr_array = apr_array_make(rec->pool, 1, sizeof(char *));
-    ap_assert(addr_array);
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    client_ip = rec->connection->client_ip;
+#else
+    client_ip = rec->connection->remote_ip;
+#endif
+
+    sources = apr_pcalloc(rec->pool, sizeof(webfw2_sources_t));
+    sources->addrs = apr_array_make(rec->pool, 1, sizeof(char *));
+    ap_assert(sources->addrs);
 
     if (!config->xff_headers) {
         /*
          * no xff headers defined, so we only look at the remote addr 
          */
-#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
-        webfw2_add_array_unique(rec->pool, addr_array, rec->connection->client_ip);
-#else
-        webfw2_add_array_unique(rec->pool, addr_array, rec->connection->remote_ip);
-#endif
-        return addr_array;
+        webfw2_sources_add_client(rec->pool, sources, client_ip);
+        return sources->addrs;
     }
 
     hdrs_arr = (apr_array_header_t *)
@@ -247,11 +597,9 @@ webfw2_find_all_sources(request_rec * rec)
          */
 
         webfw2_xff_opts_t *xff_opts;
-        char           *addr;
-        char          **addrs;
-        char          **addrs_ptr;
         int             nelts;
-        char           *header_in_value;
+        int             x;
+        const char     *header_in_value;
 
         if (!hdrs[i].key)
             continue;
@@ -259,8 +607,7 @@ webfw2_find_all_sources(request_rec * rec)
         /*
          * find the header key inside our queries headers_in 
          */
-        header_in_value =
-            (char *) apr_table_get(rec->headers_in, hdrs[i].key);
+        header_in_value = apr_table_get(rec->headers_in, hdrs[i].key);
 
         if (!header_in_value)
             /*
@@ -276,14 +623,7 @@ webfw2_find_all_sources(request_rec * rec)
          * source. 
          */
         if (xff_opts && xff_opts->source_ip &&
-            !apr_hash_get(xff_opts->source_ip,
-
-#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
-                          (char *) rec->connection->client_ip,
-#else
-                          (char *) rec->connection->remote_ip,
-#endif
-
+            !apr_hash_get(xff_opts->source_ip, client_ip,
                           APR_HASH_KEY_STRING)) {
             /*
              * printf("Untrusted source address for XFF %s\n", 
@@ -293,86 +633,36 @@ webfw2_find_all_sources(request_rec * rec)
         }
 
         /*
-         * get all the addresses we have found in the header val 
+         * find the entries of the header, which stay where they are
+         * until one of them turns out to be an address we want 
          */
-        if (!(addrs = filter_tokenize_str(header_in_value, ",", &nelts)))
-            continue;
-
-        addrs_ptr = addrs;
+        nelts = webfw2_split_xff(header_in_value, spans);
 
         /*
          * do we need to include every address within this array? 
          */
         if (!xff_opts || xff_opts->first + xff_opts->last >= nelts ||
             (xff_opts->first == 0 && xff_opts->last == 0)) {
-            /*
-             * we need to add every single address to the returned 
-             * array 
-             */
-            while ((addr = *addrs++)) {
-                if (!filter_validate_ip(addr))
-                    continue;
-
-                webfw2_add_array_unique(rec->pool, addr_array, addr);
-            }
-        } else {
-            /*
-             * only add first X and last X entries to our array 
-             */
-            int             x;
-
-            if (xff_opts->first != 0) {
-                /*
-                 * stuff the first X into the array 
-                 */
-                for (x = 0; x < xff_opts->first; x++) {
-                    if (!filter_validate_ip(addrs_ptr[x]))
-                        continue;
-
-                    /*
-                     * printf("Copying first entries %s\n", addrs_ptr[x]);
-                     */
-                    webfw2_add_array_unique(rec->pool, addr_array, addrs_ptr[x]);
-                }
-            }
-
-            if (xff_opts->last != 0) {
-                /*
-                 * stuff the last X into the array 
-                 */
-
-                /*
-                 * we skip past the last NULL byte by setting the initializer 
-                 * to nelts - 1. 
-                 */
-                for (x = nelts - 1; x >= nelts - xff_opts->last; x--) {
-                    /*
-                     * we skip over the first NULL on the end of the array 
-                     */
-                    if (addrs_ptr[x] == NULL)
-                        continue;
-
-                    if (!filter_validate_ip(addrs_ptr[x]))
-                        continue;
+            for (x = 0; x < nelts; x++)
+                webfw2_sources_add(rec->pool, sources, &spans[x]);
 
-                    /*
-                     * printf("Copying last entries %s\n", addrs_ptr[x]);
-                     */
-                    webfw2_add_array_unique(rec->pool, addr_array, addrs_ptr[x]);
-                }
-            }
+            continue;
         }
 
-        free_tokens(addrs_ptr);
+        /*
+         * only add first X and last X entries to our array, the last
+         * ones from the end backwards
+         */
+        for (x = 0; x < (int) xff_opts->first; x++)
+            webfw2_sources_add(rec->pool, sources, &spans[x]);
+
+        for (x = nelts - 1; x >= nelts - (int) xff_opts->last; x--)
+            webfw2_sources_add(rec->pool, sources, &spans[x]);
     }
 
-#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
-    webfw2_add_array_unique(rec->pool, addr_array, rec->connection->client_ip);
-#else
-    webfw2_add_array_unique(rec->pool, addr_array, rec->connection->remote_ip);
-#endif
+    webfw2_sources_add_client(rec->pool, sources, client_ip);
 
-    return addr_array;
+    return sources->addrs;
 }
 
 static void
@@ -529,12 +819,14 @@ filter_rule_t  *
 webfw2_traverse_filter(request_rec * rec,
                        webfw2_config_t * config,
                        webfw2_filter_t * filter,
+                       filter_t * ruleset,
                        filter_rule_t * current_rule,
                        apr_array_header_t * addrs, char **sip, char **dip)
 {
     char           *src_ip;
     char           *dst_ip;
     void          **callback_data;
+    filter_request_t *req;
     filter_rule_t  *rule;
     int             i,
                     ret;
@@ -542,42 +834,42 @@ webfw2_traverse_filter(request_rec * rec,
     rule = NULL;
     src_ip = dst_ip = NULL;
 
-    if (!rec->pool || !filter || !addrs)
+    if (!rec->pool || !filter || !ruleset || !addrs)
         return NULL;
 
+    /*
+     * headers, notes and the environment are fetched once for all the
+     * rules and all the source addresses of this request, only the
+     * source address changes from one pass to the next.
+     */
+    callback_data = apr_pcalloc(rec->pool, sizeof(void *) * 3);
+    dst_ip = (char *) rec->connection->local_ip;
+
+    callback_data[0] = (void *) rec;
+    callback_data[2] = (void *) dst_ip;
+
+    req = filter_request_init(rec->pool, ruleset, (void *) callback_data);
+
     for (i = 0; i < addrs->nelts; i++) {
-        current_rule = filter->filter->head;
+        current_rule = ruleset->head;
 
         ret = DECLINED;
 
-        callback_data = apr_pcalloc(rec->pool, sizeof(void *) * 3);
-
         src_ip = ((char **) addrs->elts)[i];
-        dst_ip = (char *) rec->connection->local_ip;
 
-        callback_data[0] = (void *) rec;
         callback_data[1] = (void *) src_ip;
-        callback_data[2] = (void *) dst_ip;
+        filter_request_forget(req, FILTER_FACT_SRCADDR);
 
         PRINT_DEBUG("Rule %s Traversing with %s\n",
                     current_rule->name, src_ip);
 
-        int whitelisted = 0;
-        if (filter->filter->whitelist_rule) {
-            whitelisted = filter_traverse_filter(filter->filter,
-                                                 filter->filter->whitelist_rule,
-                                                 FALSE,
-                                                 (void *) callback_data) != NULL;
-        }
+        int whitelisted = filter_request_whitelisted(req);
 
         do {
             if (!current_rule)
                 break;
 
-            rule = filter_traverse_filter(filter->filter,
-                                          current_rule,
-                                          whitelisted,
-                                          (void *) callback_data);
+            rule = filter_request_traverse(req, current_rule, whitelisted);
 
             if (!rule)
                 break;
@@ -593,9 +885,15 @@ webfw2_traverse_filter(request_rec * rec,
                  * hit. We only break out of our do loop if the
                  * response was positive. 
                  */
+#ifdef APR_HAS_THREADS
+                apr_thread_mutex_lock(filter->thrasher_mutex);
+#endif
                 ret =
                     webfw2_thrasher(rec, config, filter, src_ip,
                                     rule);
+#ifdef APR_HAS_THREADS
+                apr_thread_mutex_unlock(filter->thrasher_mutex);
+#endif
 
                 PRINT_DEBUG
                     ("Thrasher (%d) packet sent for %s. Ret status: %d\n",
@@ -635,6 +933,9 @@ webfw2_traverse_filter(request_rec * rec,
                                                rule->name);
 
                 apr_table_set(rec->notes, "webfw2_passed", curr_passes);
+                filter_request_forget(req,
+                                      filter_fact_id(ruleset,
+                                                     "webfw2_passed"));
                 current_rule = rule->next;
                 rule = NULL;
                 continue;
@@ -651,7 +952,7 @@ webfw2_traverse_filter(request_rec * rec,
             break;
 
         if (whitelisted) {
-            rule = filter->filter->whitelist_rule;
+            rule = ruleset->whitelist_rule;
             break;
         }
     }
@@ -669,6 +970,7 @@ webfw2_handler(request_rec * rec)
     char           *matched_src_ip,
                    *matched_dst_ip;
     webfw2_filter_t *wf2_filter;
+    webfw2_generation_t *gen;
     webfw2_config_t *config;
     filter_rule_t  *current_rule;
     filter_rule_t  *rule;
@@ -695,19 +997,25 @@ webfw2_handler(request_rec * rec)
 
     ap_assert(wf2_filter);
 
-    if (!wf2_filter->filter || !wf2_filter->filter->rule_count)
+    /*
+     * pin the current ruleset for the duration of this request, a reload
+     * running in another thread will not pull it out from under us. 
+     */
+    if (!(gen = webfw2_generation_acquire(wf2_filter)))
+        return DECLINED;
+
+    if (!gen->filter || !gen->filter->rule_count) {
+        webfw2_generation_release(gen);
         return DECLINED;
+    }
 
-#ifdef APR_HAS_THREADS
-    apr_thread_rwlock_wrlock(wf2_filter->rwlock);
-#endif
     webfw2_set_interesting_notes(rec);
 
     /*
      * set our current rule, which is going to be
      * the start of all rules. 
      */
-    current_rule = wf2_filter->filter->head;
+    current_rule = gen->filter->head;
 
     /*
      * grab all the source addresses within the request 
@@ -720,13 +1028,13 @@ webfw2_handler(request_rec * rec)
          */
         ret = DECLINED;
 
-        if (!current_rule || !addrs ||
-            !wf2_filter->filter || !current_rule)
+        if (!current_rule || !addrs)
             break;
 
         rule = webfw2_traverse_filter(rec,
                                       config,
                                       wf2_filter,
+                                      gen->filter,
                                       current_rule,
                                       addrs,
                                       &matched_src_ip, &matched_dst_ip);
@@ -755,7 +1063,10 @@ webfw2_handler(request_rec * rec)
             break;
         case FILTER_REDIRECT:
             ret = 302;
-            apr_table_setn(rec->headers_out, "Location", rule->redirect_url);
+            /*
+             * copy it, the ruleset may be gone once the request is 
+             */
+            apr_table_set(rec->headers_out, "Location", rule->redirect_url);
             break;
         case FILTER_REDIRECT_PARAMS:
             ret = 302;
@@ -767,7 +1078,7 @@ webfw2_handler(request_rec * rec)
             else
                 location = apr_pstrcat(rec->pool, rule->redirect_url, "?", rec->args, NULL);
             PRINT_DEBUG("redirecting to >%s<", location);
-            apr_table_setn(rec->headers_out, "Location", location);
+            apr_table_set(rec->headers_out, "Location", location);
             break;
         case FILTER_THRASH_v2:
         case FILTER_THRASH_v3:
@@ -810,14 +1121,12 @@ webfw2_handler(request_rec * rec)
         if (rule->update_rule) {
             PRINT_DEBUG("Updating Dynamic rule %s with src-ip %s\n",
                         rule->update_rule->name, matched_src_ip);
-            filter_rule_add_network(rule->update_rule, matched_src_ip,
-                                    RULE_MATCH_SRCADDR);
+            filter_rule_update_network(rule->update_rule, matched_src_ip);
         }
 
     }
-#ifdef APR_HAS_THREADS
-    apr_thread_rwlock_unlock(wf2_filter->rwlock);
-#endif
+
+    webfw2_generation_release(gen);
 
     return ret;
 }
@@ -892,6 +1201,7 @@ webfw2_init_config(apr_pool_t * pool, server_rec * svr)
                                         sizeof(*config));
 
     config->thrasher_timeout = 50000;
+    config->ipv4_table_threshold = WEBFW2_IPV4_TABLE_THRESHOLD;
 
     /*
      * set the default return action to 542 
@@ -1210,6 +1520,36 @@ cmd_hook_level(cmd_parms * cmd, void *dummy_config, const char *arg)
     return NULL;
 }
 
+static const char *
+cmd_ipv4_table_threshold(cmd_parms * cmd, void *dummy_config,
+                         const char *arg)
+{
+    webfw2_config_t *config;
+
+    config = ap_get_module_config(cmd->server->module_config,
+                                  &webfw2_module);
+
+    ap_assert(config);
+
+    config->ipv4_table_threshold = atoi(arg);
+    return NULL;
+}
+
+static const char *
+cmd_bitset_eval(cmd_parms * cmd, void *dummy_config, int flag)
+{
+    webfw2_config_t *config;
+
+    config = ap_get_module_config(cmd->server->module_config,
+                                  &webfw2_module);
+
+    ap_assert(config);
+
+    config->bitset_eval = flag;
+
+    return NULL;
+}
+
 static void
 webfw2_hooker(apr_pool_t * pool)
 {
@@ -1228,6 +1568,7 @@ webfw2_hooker(apr_pool_t * pool)
     ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL,
                  "initializing mod_webfw2 v%s", VERSION);
 
+    ap_hook_post_config(webfw2_post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_child_init(webfw2_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 
     ap_hook_translate_name(webfw2_handler_translate_hook,
@@ -1338,6 +1679,22 @@ const command_rec webfw2_directives[] = {
                  "post_read",
                  RSRC_CONF,
                  "Hook inside post_read_request(), very early on in request processing"),
+
+    AP_INIT_FLAG("webfw2_bitset_eval",
+                 cmd_bitset_eval,
+                 NULL,
+                 RSRC_CONF,
+                 "Match every rule at once, one bit per rule, instead of "
+                 "one rule after the other"),
+
+    AP_INIT_TAKE1("webfw2_ipv4_table_threshold",
+                  cmd_ipv4_table_threshold,
+                  NULL,
+                  RSRC_CONF,
+                  "Look IPv4 addresses up in flat tables for address "
+                  "lists with at least this many prefixes, 0 for never. "
+                  "Each table reserves 64MB, only the pages used are "
+                  "backed, and is rebuilt by every child on reload"),
     {NULL}
 };
 
@@ -10,11 +10,20 @@
 #include "http_request.h"
 #include "apr_reslist.h"
 #include "apr_thread_rwlock.h"
+#include "apr_atomic.h"
+#include "apr_thread_mutex.h"
 #include "apr_network_io.h"
 #include "filter.h"
 #include "version.h"
 
 #define FILTER_CONFIG_KEY "webfw2_filter_config"
+#define FILTER_PRELOAD_KEY "webfw2_filter_preload"
+
+/*
+ * address lists with this many IPv4 prefixes are looked up in flat
+ * tables (64MB each) rather than in their trie
+ */
+#define WEBFW2_IPV4_TABLE_THRESHOLD 100000
 
 typedef struct webfw2_xff_opts {
     char *xff_header;
@@ -28,8 +37,10 @@ typedef struct webfw2_config {
     uint8_t         hook_translate;
     uint8_t         hook_access;
     uint8_t         hook_post_read;
+    uint8_t         bitset_eval;
     char           *config_file;
     uint32_t        update_interval;
+    uint32_t        ipv4_table_threshold;
     char           *thrasher_host;
     int             thrasher_port;
     int             thrasher_timeout;
@@ -44,12 +55,55 @@ typedef struct webfw2_config {
     apr_array_header_t *match_header;
 } webfw2_config_t;
 
+/*
+ * one parsed ruleset. A generation is never modified once it has been
+ * published, a reload builds a new one off to the side and swaps it in.
+ * Every request holds a reference on the generation it evaluates and the
+ * last one out destroys its pool.
+ */
+typedef struct webfw2_generation {
+    filter_t             *filter;
+    apr_pool_t           *pool;
+    /*
+     * for a ruleset inherited from the parent, what its update-rules and
+     * regex caches allocate from in this child (see filter_dynamic_attach()
+     * and filter_regset_attach())
+     */
+    apr_pool_t           *dynamic_pool;
+    volatile apr_uint32_t refcount;
+    volatile apr_uint32_t reclaimed;
+} webfw2_generation_t;
+
+/*
+ * the ruleset as built by the parent during post_config. Children start
+ * out evaluating it in place, through pages inherited copy-on-write, so
+ * neither this nor anything it points to may be written once forked. The
+ * exceptions are the state of its update-rules and the caches of its
+ * regsets, which every child moves to memory of its own with
+ * filter_dynamic_attach() and filter_regset_attach() before serving
+ * requests.
+ */
+typedef struct webfw2_preload {
+    filter_t             *filter;
+    apr_time_t            mtime;
+} webfw2_preload_t;
+
 typedef struct webfw2_filter {
     apr_time_t           last_update;
     apr_time_t           last_modification;
-    filter_t            *filter;
+    webfw2_generation_t *volatile current;
     apr_pool_t          *pool;
-    apr_thread_rwlock_t *rwlock;
+    /*
+     * generation headers are allocated from here and never freed, see
+     * webfw2_generation_acquire() for why.
+     */
+    apr_pool_t          *generations;
+    apr_thread_mutex_t  *update_mutex;
+    /*
+     * requests share the filter without any locking, the thrasher socket
+     * and its state are serialized separately.
+     */
+    apr_thread_mutex_t  *thrasher_mutex;
     apr_socket_t        *thrasher_sock;
     /*
      * what time did webfw2 deem thrasher was down? 
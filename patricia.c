@@ -7,11 +7,14 @@
 #include <stdlib.h> 
 #include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "apr.h"
 #include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
 #include "patricia.h"
 
 /*
@@ -41,6 +44,51 @@ comp_with_mask(void *addr, void *dest, u_int mask)
     return (0);
 }
 
+/*
+ * parse len bytes of src as a dotted quad into the 4 bytes at dst, in a
+ * single pass that copies nothing: this runs for every address of every
+ * request as well as for every prefix of a ruleset. The address may be
+ * cut short ("10.1" is 10.1.0.0) and parts may have leading zeros,
+ * unless strict is set, in which case exactly what inet_pton() takes is
+ * taken. Returns 1, or 0 if src is no such address.
+ */
+int
+patricia_parse_ipv4(const char *src, apr_size_t len, u_char * dst,
+                    int strict)
+{
+    const char     *end = src + len;
+    u_char          xp[4] = { 0, 0, 0, 0 };
+    int             i;
+
+    for (i = 0;; i++) {
+        const char     *start = src;
+        u_int           val = 0;
+
+        while (src < end && *src >= '0' && *src <= '9') {
+            val = val * 10 + *src++ - '0';
+            if (val > 255)
+                return (0);
+        }
+
+        if (src == start || (strict && *start == '0' && src - start > 1))
+            return (0);
+
+        xp[i] = val;
+
+        if (src == end)
+            break;
+
+        if (*src++ != '.' || i >= 3)
+            return (0);
+    }
+
+    if (strict && i < 3)
+        return (0);
+
+    memcpy(dst, xp, 4);
+    return (1);
+}
+
 /*
  * this allows imcomplete prefix 
  */
@@ -48,33 +96,7 @@ int
 my_inet_pton(int af, const char *src, void *dst)
 {
     if (af == AF_INET) {
-        int             i,
-                        c,
-                        val;
-	/* not thread safe */
-        u_char          xp[4] = { 0, 0, 0, 0 };
-
-        for (i = 0;; i++) {
-            c = *src++;
-            if (!isdigit(c))
-                return (-1);
-            val = 0;
-            do {
-                val = val * 10 + c - '0';
-                if (val > 255)
-                    return (0);
-                c = *src++;
-            } while (c && isdigit(c));
-            xp[i] = val;
-            if (c == '\0')
-                break;
-            if (c != '.')
-                return (0);
-            if (i >= 3)
-                return (0);
-        }
-        memcpy(dst, xp, 4);
-        return (1);
+        return (patricia_parse_ipv4(src, strlen(src), dst, 0));
     } else if (af == AF_INET6) {
         return (inet_pton (af, src, dst));
     } else {
@@ -188,30 +210,57 @@ New_Prefix(apr_pool_t * pool, int family, void *dest, int bitlen)
 }
 
 /*
- * ascii2prefix 
+ * the length after the '/' of a prefix, read like atol() would. Anything
+ * negative or over maxbitlen is maxbitlen.
  */
-prefix_t       *
-ascii2prefix(apr_pool_t * pool, int family, char *string)
+static u_long
+ascii2bitlen(const char *cp, const char *end, u_long maxbitlen)
+{
+    u_long          bitlen = 0;
+    int             neg = 0;
+
+    while (cp < end && isspace((u_char) * cp))
+        cp++;
+
+    if (cp < end && (*cp == '+' || *cp == '-'))
+        neg = *cp++ == '-';
+
+    for (; cp < end && *cp >= '0' && *cp <= '9'; cp++) {
+        bitlen = bitlen * 10 + *cp - '0';
+        if (bitlen > maxbitlen)
+            return (maxbitlen);
+    }
+
+    if (neg && bitlen)
+        return (maxbitlen);
+
+    return (bitlen);
+}
+
+/*
+ * ascii2addrn: parse an address, or a prefix, of len bytes into dest
+ * without allocating anything. dest must have room for an in6_addr, the
+ * bytes an IPv4 address does not use are zeroed. Returns the family, 0
+ * if the string could not be parsed.
+ */
+int
+ascii2addrn(int family, const char *string, apr_size_t len, void *dest,
+            u_int * bitlenp)
 {
     u_long          bitlen,
                     maxbitlen = 0;
-    char           *cp;
-    struct in_addr  sin;
-    struct in6_addr sin6;
-    int             result;
-    /*
-     * not thread safe 
-     */
-    char save[MAXLINE];
+    const char     *cp;
+    apr_size_t      addrlen;
+    char            save[INET6_ADDRSTRLEN];
 
     if (string == NULL)
     {
-        return (NULL);
+        return (0);
     }
 
     if (family == 0) {
        family = AF_INET;
-       if (strchr (string, ':')) family = AF_INET6;
+       if (memchr (string, ':', len)) family = AF_INET6;
     }
 
     if (family == AF_INET) {
@@ -221,30 +270,61 @@ ascii2prefix(apr_pool_t * pool, int family, char *string)
         maxbitlen = 128;
     }
 
-    if ((cp = strchr(string, '/')) != NULL) {
-        bitlen = atol(cp + 1);
-        assert(cp - string < MAXLINE);
-        memcpy(save, string, cp - string);
-        save[cp - string] = '\0';
-        string = save;
-        if (bitlen < 0 || bitlen > maxbitlen)
-            bitlen = maxbitlen;
+    if ((cp = memchr(string, '/', len)) != NULL) {
+        addrlen = cp - string;
+        bitlen = ascii2bitlen(cp + 1, string + len, maxbitlen);
     } else {
+        addrlen = len;
         bitlen = maxbitlen;
     }
 
+    memset(dest, 0, sizeof(struct in6_addr));
+
     if (family == AF_INET) {
-        if ((result = my_inet_pton(AF_INET, string, &sin)) <= 0)
-	{
-            return (NULL);
-	}
-        return (New_Prefix(pool, AF_INET, &sin, bitlen));
+        if (!patricia_parse_ipv4(string, addrlen, dest, 0))
+            return (0);
     } else if (family == AF_INET6) {
-        if ((result = inet_pton (AF_INET6, string, &sin6)) <= 0)
-            return (NULL);
-	return (New_Prefix (pool, AF_INET6, &sin6, bitlen));
+        /*
+         * no IPv6 address is written with that many characters 
+         */
+        if (addrlen >= sizeof(save))
+            return (0);
+        memcpy(save, string, addrlen);
+        save[addrlen] = '\0';
+        if (inet_pton (AF_INET6, save, dest) <= 0)
+            return (0);
     } else
+        return (0);
+
+    *bitlenp = bitlen;
+    return (family);
+}
+
+/*
+ * ascii2addr: ascii2addrn() for a NUL terminated string
+ */
+int
+ascii2addr(int family, const char *string, void *dest, u_int * bitlenp)
+{
+    if (string == NULL)
+        return (0);
+
+    return (ascii2addrn(family, string, strlen(string), dest, bitlenp));
+}
+
+/*
+ * ascii2prefix 
+ */
+prefix_t       *
+ascii2prefix(apr_pool_t * pool, int family, char *string)
+{
+    struct in6_addr sin6;
+    u_int           bitlen;
+
+    if (!(family = ascii2addr(family, string, &sin6, &bitlen)))
         return (NULL);
+
+    return (New_Prefix(pool, family, &sin6, bitlen));
 }
 
 prefix_t       *
@@ -445,32 +525,24 @@ patricia_search_exact(patricia_tree_t * patricia, prefix_t * prefix)
 
 
 /*
- * if inclusive != 0, "best" may be the given prefix itself 
+ * collect the nodes with a prefix on the way down to addr, shortest
+ * first. Those are the only candidates for a prefix of addr, but they
+ * still have to be compared against it. If inclusive != 0 the node the
+ * descent stops at counts as well. 
  */
-patricia_node_t *
-patricia_search_best2(apr_pool_t * pool,
-                      patricia_tree_t * patricia, prefix_t * prefix,
-                      int inclusive)
+static int
+patricia_descend(patricia_tree_t * patricia, const u_char * addr,
+                 u_int bitlen, int inclusive, patricia_node_t ** stack)
 {
     patricia_node_t *node;
-    patricia_node_t *stack[PATRICIA_MAXBITS + 1];
-    u_char         *addr;
-    u_int           bitlen;
     int             cnt = 0;
 
-    if (!patricia || !prefix)
-	return NULL;
-
-    assert(patricia);
-    assert(prefix);
-    assert(prefix->bitlen <= patricia->maxbits);
+    assert(bitlen <= patricia->maxbits);
 
     if (patricia->head == NULL)
-        return (NULL);
+        return (0);
 
     node = patricia->head;
-    addr = prefix_touchar(prefix);
-    bitlen = prefix->bitlen;
 
     while (node->bit < bitlen) {
 
@@ -491,19 +563,396 @@ patricia_search_best2(apr_pool_t * pool,
     if (inclusive && node && node->prefix)
         stack[cnt++] = node;
 
-    if (cnt <= 0)
-        return (NULL);
+    return (cnt);
+}
+
+/*
+ * if inclusive != 0, "best" may be the given address itself 
+ */
+static patricia_node_t *
+patricia_search_best_bits(patricia_tree_t * patricia, const u_char * addr,
+                          u_int bitlen, int inclusive)
+{
+    patricia_node_t *node;
+    patricia_node_t *stack[PATRICIA_MAXBITS + 1];
+    int             cnt;
+
+    cnt = patricia_descend(patricia, addr, bitlen, inclusive, stack);
 
     while (--cnt >= 0) {
         node = stack[cnt];
         if (comp_with_mask(prefix_tochar(node->prefix),
-                           prefix_tochar(prefix), node->prefix->bitlen)) {
+                           (void *) addr, node->prefix->bitlen)) {
             return (node);
         }
     }
     return (NULL);
 }
 
+/*
+ * if inclusive != 0, "best" may be the given prefix itself 
+ */
+patricia_node_t *
+patricia_search_best2(apr_pool_t * pool,
+                      patricia_tree_t * patricia, prefix_t * prefix,
+                      int inclusive)
+{
+    if (!patricia || !prefix)
+	return NULL;
+
+    return (patricia_search_best_bits(patricia, prefix_touchar(prefix),
+                                      prefix->bitlen, inclusive));
+}
+
+/*
+ * patricia_search_best() for an address which has already been parsed
+ * (see ascii2addr()), nothing is allocated.
+ */
+patricia_node_t *
+patricia_search_best_addr(patricia_tree_t * patricia, const void *addr,
+                          u_int bitlen)
+{
+    if (!patricia || !addr)
+	return NULL;
+
+    return (patricia_search_best_bits(patricia, addr, bitlen, 1));
+}
+
+/*
+ * every node whose prefix holds the (parsed) address, the longest one
+ * first, the best match patricia_search_best_addr() would return. nodes
+ * needs room for PATRICIA_MAXBITS + 1 of them. Returns how many there are.
+ */
+int
+patricia_search_all_addr(patricia_tree_t * patricia, const void *addr,
+                         u_int bitlen, patricia_node_t ** nodes)
+{
+    patricia_node_t *stack[PATRICIA_MAXBITS + 1];
+    int             cnt,
+                    n = 0;
+
+    if (!patricia || !addr)
+	return 0;
+
+    cnt = patricia_descend(patricia, addr, bitlen, 1, stack);
+
+    while (--cnt >= 0) {
+        if (comp_with_mask(prefix_tochar(stack[cnt]->prefix),
+                           (void *) addr, stack[cnt]->prefix->bitlen))
+            nodes[n++] = stack[cnt];
+    }
+    return (n);
+}
+
+
+/*
+ * copy node and what is under it to the next free slots of frozen,
+ * returning the index it went to
+ */
+static u_int
+patricia_freeze_node(patricia_frozen_t * frozen, patricia_node_t * node)
+{
+    patricia_frozen_node_t *fnode;
+    u_int           i = frozen->count++;
+
+    fnode = &frozen->nodes[i];
+    fnode->bit = node->bit;
+    fnode->data = node->data;
+
+    if (node->prefix) {
+        fnode->bitlen = node->prefix->bitlen;
+        memcpy(fnode->addr, prefix_tochar(node->prefix),
+               node->prefix->family == AF_INET ? 4 : 16);
+    } else
+        fnode->bitlen = PATRICIA_GLUE;
+
+    /*
+     * the left child goes right after its parent, so a descent going
+     * left stays within the same few cache lines 
+     */
+    if (node->l)
+        frozen->nodes[i].child[0] = patricia_freeze_node(frozen, node->l);
+    if (node->r)
+        frozen->nodes[i].child[1] = patricia_freeze_node(frozen, node->r);
+
+    return (i);
+}
+
+/*
+ * the read-only copy of a tree, allocated from pool. The tree itself is
+ * left as it is and can go away afterwards, the data of its nodes is
+ * shared.
+ */
+patricia_frozen_t *
+patricia_freeze(apr_pool_t * pool, patricia_tree_t * patricia)
+{
+    patricia_frozen_t *frozen;
+    patricia_node_t *node;
+    u_int           count = 0;
+
+    frozen = apr_pcalloc(pool, sizeof(patricia_frozen_t));
+    frozen->maxbits = patricia->maxbits;
+
+    PATRICIA_WALK_ALL(patricia->head, node) {
+        count++;
+    } PATRICIA_WALK_END;
+
+    if (!count)
+        return (frozen);
+
+    frozen->nodes = apr_pcalloc(pool, count * sizeof(patricia_frozen_node_t));
+    patricia_freeze_node(frozen, patricia->head);
+
+    return (frozen);
+}
+
+/*
+ * patricia_search_all_addr() for a frozen tree, returning the data of the
+ * nodes instead of the nodes themselves.
+ */
+int
+patricia_frozen_search_all(const patricia_frozen_t * frozen,
+                           const void *addr, u_int bitlen, void **data)
+{
+    const patricia_frozen_node_t *stack[PATRICIA_MAXBITS + 1];
+    const patricia_frozen_node_t *node;
+    const u_char   *a = addr;
+    int             cnt = 0,
+                    n = 0;
+
+    if (!frozen || !frozen->count || !addr)
+        return 0;
+
+    assert(bitlen <= frozen->maxbits);
+
+    if (frozen->tbl24 && bitlen == 32) {
+        u_int           e,
+                        i;
+
+        e = frozen->tbl24[(a[0] << 16) | (a[1] << 8) | a[2]];
+
+        if (e & PATRICIA_TBL_CHUNK)
+            e = frozen->tbl8[((e & ~PATRICIA_TBL_CHUNK) << 8) | a[3]];
+
+        if (e != PATRICIA_TBL_TRIE) {
+            if (!e--)
+                return 0;
+
+            for (i = frozen->held[e]; i < frozen->held[e + 1]; i++)
+                data[n++] = frozen->held_data[i];
+
+            return (n);
+        }
+    }
+
+    node = frozen->nodes;
+
+    while (node->bit < bitlen) {
+        u_int           next;
+
+        if (node->bitlen != PATRICIA_GLUE)
+            stack[cnt++] = node;
+
+        next = node->child[BIT_TEST(a[node->bit >> 3],
+                                    0x80 >> (node->bit & 0x07)) != 0];
+
+        if (!next) {
+            node = NULL;
+            break;
+        }
+
+        node = &frozen->nodes[next];
+    }
+
+    if (node && node->bitlen != PATRICIA_GLUE)
+        stack[cnt++] = node;
+
+    while (--cnt >= 0) {
+        if (comp_with_mask((void *) stack[cnt]->addr, (void *) addr,
+                           stack[cnt]->bitlen))
+            data[n++] = stack[cnt]->data;
+    }
+    return (n);
+}
+
+/*
+ * the chunk of tbl8 under slot of tbl24, made (and filled with what the
+ * slot held) if there isn't one yet
+ */
+static u_int   *
+patricia_tbl_chunk(u_int * tbl24, apr_array_header_t * tbl8, u_int slot)
+{
+    u_int          *chunk;
+    int             i;
+
+    if (tbl24[slot] & PATRICIA_TBL_CHUNK)
+        return ((u_int *) tbl8->elts +
+                ((tbl24[slot] & ~PATRICIA_TBL_CHUNK) << 8));
+
+    chunk = apr_array_push(tbl8);
+
+    for (i = 0; i < 256; i++)
+        chunk[i] = tbl24[slot];
+
+    tbl24[slot] = PATRICIA_TBL_CHUNK | (tbl8->nelts - 1);
+
+    return (chunk);
+}
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define PATRICIA_TBL24_SIZE ((1 << 24) * sizeof(u_int))
+
+static apr_status_t
+patricia_tbl24_unmap(void *tbl24)
+{
+    munmap(tbl24, PATRICIA_TBL24_SIZE);
+    return APR_SUCCESS;
+}
+
+/*
+ * lay the prefixes of at most 32 bits of a frozen tree out as flat
+ * tables (DIR-24-8), so that a 32 bit search takes two lookups at most
+ * whatever the size of the tree. tbl24 alone is 64MB of address space,
+ * this is only done for trees with at least min_prefixes such prefixes.
+ * It is an anonymous mapping rather than pool memory so that only the
+ * pages the prefixes land on are ever backed, the untouched ones read
+ * as the zero page. Returns 1 if the tables were made.
+ */
+int
+patricia_frozen_tabulate(apr_pool_t * pool, patricia_frozen_t * frozen,
+                         u_int min_prefixes)
+{
+    patricia_frozen_node_t *nodes = frozen->nodes;
+    apr_pool_t     *tpool;
+    apr_array_header_t *tbl8;
+    void           *found[PATRICIA_MAXBITS + 1];
+    u_int           bybits[34];
+    u_int          *order,
+                   *tbl24;
+    u_int           prefixes = 0,
+                    i,
+                    j;
+    int             n;
+
+    for (i = 0; i < frozen->count; i++)
+        if (nodes[i].bitlen <= 32)
+            prefixes++;
+
+    if (!prefixes || prefixes < min_prefixes)
+        return (0);
+
+    if (apr_pool_create(&tpool, pool) != APR_SUCCESS)
+        return (0);
+
+    tbl24 = mmap(NULL, PATRICIA_TBL24_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (tbl24 == MAP_FAILED) {
+        apr_pool_destroy(tpool);
+        return (0);
+    }
+
+    apr_pool_cleanup_register(pool, tbl24, patricia_tbl24_unmap,
+                              apr_pool_cleanup_null);
+
+    /*
+     * all the prefixes holding a 32 bit address are the longest one and
+     * the ones holding it in turn 
+     */
+    frozen->held = apr_palloc(pool, (frozen->count + 1) * sizeof(u_int));
+
+    for (i = 0, j = 0; i < frozen->count; i++) {
+        frozen->held[i] = j;
+        if (nodes[i].bitlen <= 32)
+            j += patricia_frozen_search_all(frozen, nodes[i].addr,
+                                            nodes[i].bitlen, found);
+    }
+
+    frozen->held[i] = j;
+    frozen->held_data = apr_palloc(pool, (j + 1) * sizeof(void *));
+
+    for (i = 0; i < frozen->count; i++) {
+        if (nodes[i].bitlen > 32)
+            continue;
+
+        n = patricia_frozen_search_all(frozen, nodes[i].addr,
+                                       nodes[i].bitlen, found);
+        memcpy(frozen->held_data + frozen->held[i], found,
+               n * sizeof(void *));
+    }
+
+    /*
+     * fill the tables shortest prefixes first, the longer ones overwrite
+     * what they hold 
+     */
+    order = apr_palloc(tpool, prefixes * sizeof(u_int));
+    memset(bybits, 0, sizeof(bybits));
+
+    for (i = 0; i < frozen->count; i++)
+        if (nodes[i].bitlen <= 32)
+            bybits[nodes[i].bitlen + 1]++;
+
+    for (i = 1; i < 34; i++)
+        bybits[i] += bybits[i - 1];
+
+    for (i = 0; i < frozen->count; i++)
+        if (nodes[i].bitlen <= 32)
+            order[bybits[nodes[i].bitlen]++] = i;
+
+    tbl8 = apr_array_make(tpool, 64, 256 * sizeof(u_int));
+
+    for (i = 0; i < prefixes; i++) {
+        patricia_frozen_node_t *node = &nodes[order[i]];
+        u_int           slot,
+                        span,
+                        k;
+
+        slot = (node->addr[0] << 16) | (node->addr[1] << 8) | node->addr[2];
+
+        if (node->bitlen <= 24) {
+            span = 1 << (24 - node->bitlen);
+            slot &= ~(span - 1);
+
+            for (k = 0; k < span; k++)
+                tbl24[slot + k] = order[i] + 1;
+        } else {
+            u_int          *chunk = patricia_tbl_chunk(tbl24, tbl8, slot);
+            u_int           last = node->addr[3];
+
+            span = 1 << (32 - node->bitlen);
+            last &= ~(span - 1);
+
+            for (k = 0; k < span; k++)
+                chunk[last + k] = order[i] + 1;
+        }
+    }
+
+    /*
+     * a longer prefix is only ever the node a 32 bit search ends on, for
+     * the one address made of its first 32 bits: leave that to the nodes 
+     */
+    for (i = 0; i < frozen->count; i++) {
+        patricia_frozen_node_t *node = &nodes[i];
+
+        if (node->bitlen <= 32 || node->bitlen == PATRICIA_GLUE)
+            continue;
+
+        patricia_tbl_chunk(tbl24, tbl8,
+                           (node->addr[0] << 16) | (node->addr[1] << 8) |
+                           node->addr[2])[node->addr[3]] = PATRICIA_TBL_TRIE;
+    }
+
+    frozen->tbl8 = apr_pmemdup(pool, tbl8->elts,
+                               tbl8->nelts * 256 * sizeof(u_int));
+    frozen->tbl24 = tbl24;
+
+    apr_pool_destroy(tpool);
+
+    return (1);
+}
 
 patricia_node_t *
 patricia_search_best(apr_pool_t * pool, patricia_tree_t * patricia,
@@ -92,6 +92,44 @@ typedef struct _patricia_tree_t {
     int             num_active_node;    /* for debug purpose */
 } patricia_tree_t;
 
+/*
+ * the read-only form of a tree, made by patricia_freeze() once nothing
+ * more is added to it: all of its nodes in one array, in depth first
+ * order with the root first, children by index (0 for none, the root
+ * being nobody's child) and prefixes inline. A glue node has a bitlen
+ * of PATRICIA_GLUE.
+ */
+typedef struct _patricia_frozen_node_t {
+    u_int           child[2];
+    u_short         bit;
+    u_short         bitlen;
+    u_char          addr[16];
+    void           *data;
+} patricia_frozen_node_t;
+
+typedef struct _patricia_frozen_t {
+    patricia_frozen_node_t *nodes;
+    u_int           count;
+    u_int           maxbits;
+    /*
+     * with patricia_frozen_tabulate(), 32 bit searches are answered by
+     * two flat tables instead: tbl24 by the first 24 bits of the address
+     * and, for the slots that are PATRICIA_TBL_CHUNK, a chunk of tbl8 by
+     * the last 8. An entry is 0 for no prefix, PATRICIA_TBL_TRIE to
+     * search the nodes after all, or one more than the node holding the
+     * longest prefix. held[i] to held[i + 1] are the data of every prefix
+     * holding node i's, longest first, in held_data.
+     */
+    u_int          *tbl24;
+    u_int          *tbl8;
+    u_int          *held;
+    void          **held_data;
+} patricia_frozen_t;
+
+#define PATRICIA_GLUE 0xffff
+#define PATRICIA_TBL_CHUNK 0x80000000U
+#define PATRICIA_TBL_TRIE  0x7fffffffU
+
 
 patricia_node_t *patricia_search_exact(patricia_tree_t * patricia,
                                        prefix_t * prefix);
@@ -101,6 +139,11 @@ patricia_node_t *patricia_search_best(apr_pool_t *,
 patricia_node_t *patricia_search_best2(apr_pool_t *,
                                        patricia_tree_t * patricia,
                                        prefix_t * prefix, int inclusive);
+patricia_node_t *patricia_search_best_addr(patricia_tree_t * patricia,
+                                           const void *addr, u_int bitlen);
+int             patricia_search_all_addr(patricia_tree_t * patricia,
+                                         const void *addr, u_int bitlen,
+                                         patricia_node_t ** nodes);
 patricia_node_t *patricia_lookup(apr_pool_t * pool,
                                  patricia_tree_t * patricia,
                                  prefix_t * prefix);
@@ -112,12 +155,23 @@ void            Destroy_Patricia(patricia_tree_t * patricia,
                                  void_fn_t func);
 void            patricia_process(patricia_tree_t * patricia,
                                  void_fn_t func);
+patricia_frozen_t *patricia_freeze(apr_pool_t *, patricia_tree_t *);
+int             patricia_frozen_tabulate(apr_pool_t *, patricia_frozen_t *,
+                                         u_int);
+int             patricia_frozen_search_all(const patricia_frozen_t *,
+                                           const void *addr, u_int bitlen,
+                                           void **data);
 
 /*
  * { from demo.c 
  */
 
 prefix_t       *ascii2prefix(apr_pool_t *, int, char *);
+int             ascii2addr(int, const char *, void *, u_int *);
+int             ascii2addrn(int, const char *, apr_size_t, void *, u_int *);
+int             patricia_parse_ipv4(const char *, apr_size_t, u_char *, int);
+prefix_t       *New_Prefix(apr_pool_t *, int, void *, int);
+void            Deref_Prefix(prefix_t *);
 
 patricia_node_t *make_and_lookup(apr_pool_t *, patricia_tree_t *, char *);
 
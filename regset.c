@@ -0,0 +1,1630 @@
+/******************************************************************************/
+/* regset.c  -- match a string against a set of regular expressions at once
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "apr_atomic.h"
+#include "regset.h"
+
+/*
+ * the automaton is a Thompson NFA of all the patterns of the set. Each
+ * piece of a pattern becomes a fragment with a single entry and a single
+ * (REGSET_EMPTY) exit state which is patched to whatever comes next.
+ */
+#define REGSET_CHAR       1
+#define REGSET_SPLIT      2
+#define REGSET_EMPTY      3
+#define REGSET_BOL        4
+#define REGSET_EOL        5
+#define REGSET_MATCH      6
+
+/*
+ * limits keeping a hostile or merely huge set in check, a pattern which
+ * would go over them is left to regexec()
+ */
+#define REGSET_MAX_NFA    32768
+#define REGSET_MAX_REPEAT 64
+#define REGSET_MAX_DEPTH  64
+
+/*
+ * deterministic states cached before the cache is dropped and rebuilt
+ */
+#define REGSET_MAX_DFA    512
+#define REGSET_BUCKETS    1024
+
+/*
+ * past this many literals, looking for each of them costs more than the
+ * automaton pass they could save
+ */
+#define REGSET_MAX_LITERALS 8
+
+/*
+ * the escapes regcomp() takes as the character itself, every other one
+ * (\w, \<, \', \1...) means something else to it
+ */
+#define REGSET_LITERAL_ESCAPE(c) ((c) && strchr(".[]()*+?{}|^$\\/", (c)))
+
+typedef struct regset_nstate {
+    int             type;
+    int             out;
+    int             out1;
+    int             cls;
+} regset_nstate_t;
+
+typedef struct regset_class {
+    uint32_t        bits[8];
+} regset_class_t;
+
+#define CLASS_SET(c, b)  ((c)->bits[(b) >> 5] |= 1U << ((b) & 31))
+#define REGSET_SET(ids, id) ((ids)[(id) >> 5] |= 1U << ((id) & 31))
+#define REGSET_TEST(ids, id) ((ids)[(id) >> 5] & (1U << ((id) & 31)))
+#define CLASS_TEST(c, b) ((c)->bits[(b) >> 5] & (1U << ((b) & 31)))
+
+typedef struct regset_frag {
+    int             start;
+    int             end;
+} regset_frag_t;
+
+/*
+ * a pattern left to regexec()
+ */
+typedef struct regset_fallback {
+    const regex_t  *regex;
+    const char     *literal;
+    uint32_t        id;
+} regset_fallback_t;
+
+typedef struct regset_dstate regset_dstate_t;
+
+struct regset_dstate {
+    regset_dstate_t *hnext;
+    unsigned        hash;
+    /*
+     * a pattern matched ending at this point, or would if the string
+     * ended here: the ids of the first nids of them (ids) or of all
+     * nids_end of them.
+     */
+    int             accept;
+    int             accept_end;
+    int             nids;
+    int             nids_end;
+    uint32_t       *ids;
+    int             n;
+    int            *set;
+    /*
+     * set with the cache's lock held, once the state it points to is
+     * complete. Read without it.
+     */
+    regset_dstate_t *volatile *next;
+};
+
+/*
+ * what it takes to compute a set of states, the ones for the cache are
+ * part of it and only used with its lock held.
+ */
+typedef struct regset_scratch {
+    unsigned       *mark;
+    unsigned        gen;
+    int            *stack;
+    int            *from;
+    int            *cur;
+    int            *nxt;
+} regset_scratch_t;
+
+/*
+ * everything matching writes to: the cached states and the scratch space
+ * to make them in. A cache belongs to the process matching, which made
+ * it with regset_attach(), never to the one that built the regset. The
+ * scratch space and buckets are only allocated once something is matched.
+ *
+ * Threads follow the transitions already made without taking the lock,
+ * only a missing one is made with it held. A full cache is not freed in
+ * place, as others may still be walking it: its states are set aside in
+ * retired and freed once no thread is in the cache (readers is 0).
+ */
+typedef struct regset_cache {
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+#endif
+    volatile apr_uint32_t readers;
+    regset_scratch_t scratch;
+    regset_dstate_t **buckets;
+    regset_dstate_t *volatile initial;
+    int             ndstates;
+    regset_dstate_t *volatile retired;
+} regset_cache_t;
+
+struct regset {
+    apr_pool_t     *pool;
+
+    apr_array_header_t *nfa;
+    apr_array_header_t *classes;
+    apr_array_header_t *starts;
+    apr_array_header_t *fallback;
+
+    /*
+     * the literals of the patterns in the automaton, and how many of
+     * them have none
+     */
+    apr_array_header_t *literals;
+    int             unfiltered;
+
+    /*
+     * set by regset_finish()
+     */
+    regset_nstate_t *states;
+    int             nstates;
+    regset_class_t *cls;
+    uint8_t         byteclass[256];
+    uint8_t         rep[256];
+    int             nclasses;
+
+    /*
+     * the only thing set once the regset is finished, by regset_attach()
+     */
+    regset_cache_t *cache;
+};
+
+/*
+ * a pattern being parsed
+ */
+typedef struct regset_parser {
+    regset_t       *rs;
+    const char     *pattern;
+    const char     *p;
+    int             depth;
+} regset_parser_t;
+
+static int      regset_parse_alt(regset_parser_t *, regset_frag_t *);
+
+static int
+regset_state(regset_t * rs, int type, int out, int out1, int cls)
+{
+    regset_nstate_t *st;
+
+    if (rs->nfa->nelts >= REGSET_MAX_NFA)
+        return -1;
+
+    st = (regset_nstate_t *) apr_array_push(rs->nfa);
+    st->type = type;
+    st->out = out;
+    st->out1 = out1;
+    st->cls = cls;
+
+    return rs->nfa->nelts - 1;
+}
+
+#define NSTATE(rs, i) (&((regset_nstate_t *) (rs)->nfa->elts)[i])
+
+static int
+regset_frag_make(regset_t * rs, int type, int cls, regset_frag_t * f)
+{
+    if ((f->end = regset_state(rs, REGSET_EMPTY, -1, -1, 0)) == -1 ||
+        (f->start = regset_state(rs, type, f->end, -1, cls)) == -1)
+        return -1;
+
+    return 0;
+}
+
+static void
+regset_frag_cat(regset_t * rs, regset_frag_t * a, regset_frag_t * b)
+{
+    NSTATE(rs, a->end)->out = b->start;
+    a->end = b->end;
+}
+
+/*
+ * a* (greedy or not makes no difference to whether it matches)
+ */
+static int
+regset_frag_star(regset_t * rs, regset_frag_t * a)
+{
+    int             split,
+                    end;
+
+    if ((end = regset_state(rs, REGSET_EMPTY, -1, -1, 0)) == -1 ||
+        (split = regset_state(rs, REGSET_SPLIT, a->start, end, 0)) == -1)
+        return -1;
+
+    NSTATE(rs, a->end)->out = split;
+    a->start = split;
+    a->end = end;
+    return 0;
+}
+
+static int
+regset_frag_plus(regset_t * rs, regset_frag_t * a)
+{
+    int             split,
+                    end;
+
+    if ((end = regset_state(rs, REGSET_EMPTY, -1, -1, 0)) == -1 ||
+        (split = regset_state(rs, REGSET_SPLIT, a->start, end, 0)) == -1)
+        return -1;
+
+    NSTATE(rs, a->end)->out = split;
+    a->end = end;
+    return 0;
+}
+
+static int
+regset_frag_quest(regset_t * rs, regset_frag_t * a)
+{
+    int             split;
+
+    if ((split = regset_state(rs, REGSET_SPLIT, a->start, a->end, 0)) == -1)
+        return -1;
+
+    a->start = split;
+    return 0;
+}
+
+static int
+regset_class_new(regset_t * rs, regset_class_t ** c)
+{
+    *c = (regset_class_t *) apr_array_push(rs->classes);
+    memset(*c, 0, sizeof(regset_class_t));
+    return rs->classes->nelts - 1;
+}
+
+/*
+ * the character classes of a bracket expression, as defined for the "C"
+ * locale
+ */
+static int
+regset_named_class(const char *name, size_t len, regset_class_t * c)
+{
+    static const struct {
+        const char     *name;
+        int             (*test) (int);
+    } named[] = {
+        { "alpha",  isalpha },
+        { "digit",  isdigit },
+        { "alnum",  isalnum },
+        { "upper",  isupper },
+        { "lower",  islower },
+        { "space",  isspace },
+        { "punct",  ispunct },
+        { "print",  isprint },
+        { "graph",  isgraph },
+        { "cntrl",  iscntrl },
+        { "xdigit", isxdigit },
+        { "blank",  isblank },
+        { NULL, NULL }
+    };
+    int             i,
+                    b;
+
+    for (i = 0; named[i].name; i++) {
+        if (strlen(named[i].name) != len || strncmp(named[i].name, name, len))
+            continue;
+
+        for (b = 1; b < 128; b++)
+            if (named[i].test(b))
+                CLASS_SET(c, b);
+
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * [...], p points past the opening bracket
+ */
+static int
+regset_parse_bracket(regset_parser_t * ps, regset_frag_t * f)
+{
+    regset_class_t *c;
+    regset_class_t  set;
+    const char     *p = ps->p;
+    int             negate = 0,
+                    first = 1,
+                    cls,
+                    b;
+
+    memset(&set, 0, sizeof(set));
+
+    if (*p == '^') {
+        negate = 1;
+        p++;
+    }
+
+    for (;; first = 0) {
+        unsigned char   lo,
+                        hi;
+
+        if (!*p || (unsigned char) *p >= 0x80)
+            return -1;
+
+        if (*p == ']' && !first)
+            break;
+
+        if (*p == '[' && p[1] == ':') {
+            const char     *end = strstr(p + 2, ":]");
+
+            if (!end || regset_named_class(p + 2, end - p - 2, &set) == -1)
+                return -1;
+
+            p = end + 2;
+
+            /*
+             * a class can not start a range
+             */
+            if (*p == '-' && p[1] != ']')
+                return -1;
+
+            continue;
+        }
+
+        /*
+         * collating elements and equivalence classes
+         */
+        if (*p == '[' && (p[1] == '.' || p[1] == '='))
+            return -1;
+
+        lo = hi = (unsigned char) *p++;
+
+        if (*p == '-' && p[1] && p[1] != ']') {
+            if (p[1] == '[' || (unsigned char) p[1] >= 0x80)
+                return -1;
+
+            hi = (unsigned char) p[1];
+            p += 2;
+
+            if (hi < lo)
+                return -1;
+        }
+
+        for (b = lo; b <= hi; b++)
+            CLASS_SET(&set, b);
+    }
+
+    ps->p = p + 1;
+
+    cls = regset_class_new(ps->rs, &c);
+
+    for (b = 1; b < 256; b++)
+        if ((CLASS_TEST(&set, b) != 0) != negate)
+            CLASS_SET(c, b);
+
+    return regset_frag_make(ps->rs, REGSET_CHAR, cls, f);
+}
+
+static int
+regset_parse_char(regset_parser_t * ps, int from, int to, regset_frag_t * f)
+{
+    regset_class_t *c;
+    int             cls,
+                    b;
+
+    cls = regset_class_new(ps->rs, &c);
+
+    for (b = from; b <= to; b++)
+        CLASS_SET(c, b);
+
+    return regset_frag_make(ps->rs, REGSET_CHAR, cls, f);
+}
+
+static int
+regset_parse_atom(regset_parser_t * ps, regset_frag_t * f)
+{
+    unsigned char   c = (unsigned char) *ps->p;
+
+    if (c >= 0x80)
+        return -1;
+
+    switch (c) {
+    case '(':
+        if (++ps->depth > REGSET_MAX_DEPTH)
+            return -1;
+
+        ps->p++;
+
+        if (*ps->p == ')' || regset_parse_alt(ps, f) == -1 || *ps->p != ')')
+            return -1;
+
+        ps->p++;
+        ps->depth--;
+        return 0;
+    case '[':
+        ps->p++;
+        return regset_parse_bracket(ps, f);
+    case '.':
+        ps->p++;
+        return regset_parse_char(ps, 1, 255, f);
+    case '^':
+        /*
+         * glibc anchors anywhere but the very edges of a pattern to line
+         * breaks as well, leave those to regexec()
+         */
+        if (ps->p != ps->pattern)
+            return -1;
+
+        ps->p++;
+        return regset_frag_make(ps->rs, REGSET_BOL, 0, f);
+    case '$':
+        if (ps->p[1])
+            return -1;
+
+        ps->p++;
+        return regset_frag_make(ps->rs, REGSET_EOL, 0, f);
+    case '\\':
+        /*
+         * only an escaped metacharacter is a plain character, \w, \<, \`,
+         * \1 and friends are GNU extensions left to regexec()
+         */
+        c = (unsigned char) ps->p[1];
+
+        if (!REGSET_LITERAL_ESCAPE(c))
+            return -1;
+
+        ps->p += 2;
+        return regset_parse_char(ps, c, c, f);
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case '}':
+    case '|':
+    case ')':
+    case '\0':
+        return -1;
+    default:
+        ps->p++;
+        return regset_parse_char(ps, c, c, f);
+    }
+}
+
+/*
+ * {m}, {m,} or {m,n}, p points at the opening brace
+ */
+static int
+regset_parse_bound(regset_parser_t * ps, int *min, int *max)
+{
+    const char     *p = ps->p + 1;
+    char           *end;
+
+    if (!isdigit((unsigned char) *p))
+        return -1;
+
+    *min = *max = (int) strtol(p, &end, 10);
+    p = end;
+
+    if (*p == ',') {
+        p++;
+
+        if (*p == '}')
+            *max = -1;
+        else if (!isdigit((unsigned char) *p))
+            return -1;
+        else {
+            *max = (int) strtol(p, &end, 10);
+            p = end;
+        }
+    }
+
+    if (*p != '}' || *min > REGSET_MAX_REPEAT || *max > REGSET_MAX_REPEAT ||
+        (*max != -1 && *max < *min))
+        return -1;
+
+    ps->p = p + 1;
+    return 0;
+}
+
+/*
+ * an atom repeated {min,max} times. There is no copying a fragment, the
+ * atom is parsed again for every repetition.
+ */
+static int
+regset_parse_repeat(regset_parser_t * ps, const char *atom, int min,
+                    int max, regset_frag_t * f)
+{
+    regset_frag_t   one;
+    const char     *after = ps->p;
+    int             i,
+                    have = 0;
+
+    for (i = 0; i < (max == -1 ? min + 1 : max); i++) {
+        ps->p = atom;
+
+        if (regset_parse_atom(ps, &one) == -1)
+            return -1;
+
+        if (i >= min) {
+            if ((max == -1 ? regset_frag_star(ps->rs, &one) :
+                 regset_frag_quest(ps->rs, &one)) == -1)
+                return -1;
+        }
+
+        if (have)
+            regset_frag_cat(ps->rs, f, &one);
+        else
+            *f = one;
+
+        have = 1;
+    }
+
+    ps->p = after;
+
+    /*
+     * {0} or {0,0}
+     */
+    if (!have)
+        return regset_frag_make(ps->rs, REGSET_EMPTY, 0, f);
+
+    return 0;
+}
+
+static int
+regset_parse_piece(regset_parser_t * ps, regset_frag_t * f)
+{
+    const char     *atom = ps->p;
+    int             quantified = 0,
+                    anchor;
+
+    anchor = *ps->p == '^' || *ps->p == '$';
+
+    if (regset_parse_atom(ps, f) == -1)
+        return -1;
+
+    for (;; quantified = 1) {
+        int             min,
+                        max,
+                        ret;
+
+        switch (*ps->p) {
+        case '*':
+            ps->p++;
+            ret = regset_frag_star(ps->rs, f);
+            break;
+        case '+':
+            ps->p++;
+            ret = regset_frag_plus(ps->rs, f);
+            break;
+        case '?':
+            ps->p++;
+            ret = regset_frag_quest(ps->rs, f);
+            break;
+        case '{':
+            /*
+             * a bound on something that was already repeated would
+             * have to parse more than the atom again
+             */
+            if (quantified || regset_parse_bound(ps, &min, &max) == -1)
+                return -1;
+
+            ret = regset_parse_repeat(ps, atom, min, max, f);
+            break;
+        default:
+            return 0;
+        }
+
+        if (ret == -1 || anchor)
+            return -1;
+    }
+}
+
+static int
+regset_parse_concat(regset_parser_t * ps, regset_frag_t * f)
+{
+    regset_frag_t   next;
+
+    /*
+     * an empty alternative matches everywhere, which regexec() knows
+     * best how to go about
+     */
+    if (!*ps->p || *ps->p == '|' || *ps->p == ')')
+        return -1;
+
+    if (regset_parse_piece(ps, f) == -1)
+        return -1;
+
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        if (regset_parse_piece(ps, &next) == -1)
+            return -1;
+
+        regset_frag_cat(ps->rs, f, &next);
+    }
+
+    return 0;
+}
+
+static int
+regset_parse_alt(regset_parser_t * ps, regset_frag_t * f)
+{
+    regset_frag_t   next;
+    int             split,
+                    end;
+
+    if (regset_parse_concat(ps, f) == -1)
+        return -1;
+
+    while (*ps->p == '|') {
+        ps->p++;
+
+        if (regset_parse_concat(ps, &next) == -1)
+            return -1;
+
+        if ((end = regset_state(ps->rs, REGSET_EMPTY, -1, -1, 0)) == -1 ||
+            (split = regset_state(ps->rs, REGSET_SPLIT, f->start,
+                                  next.start, 0)) == -1)
+            return -1;
+
+        NSTATE(ps->rs, f->end)->out = end;
+        NSTATE(ps->rs, next.end)->out = end;
+        f->start = split;
+        f->end = end;
+    }
+
+    return 0;
+}
+
+/*
+ * the end of the bracket expression starting at p, NULL if it has none
+ */
+static const char *
+regset_skip_bracket(const char *p)
+{
+    p++;
+
+    if (*p == '^')
+        p++;
+
+    if (*p == ']')
+        p++;
+
+    for (; *p && *p != ']'; p++) {
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char            close[3] = { p[1], ']', 0 };
+
+            if (!(p = strstr(p + 2, close)))
+                return NULL;
+
+            p++;
+        }
+    }
+
+    return *p ? p + 1 : NULL;
+}
+
+/*
+ * the end of the group starting at p, NULL if it has none
+ */
+static const char *
+regset_skip_group(const char *p)
+{
+    int             depth = 0;
+
+    while (*p) {
+        switch (*p) {
+        case '(':
+            depth++;
+            p++;
+            break;
+        case ')':
+            p++;
+            if (!--depth)
+                return p;
+            break;
+        case '[':
+            if (!(p = regset_skip_bracket(p)))
+                return NULL;
+            break;
+        case '\\':
+            if (!p[1])
+                return NULL;
+            p += 2;
+            break;
+        default:
+            p++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * the longest run of plain characters every match of an extended regular
+ * expression has to contain, allocated from pool. NULL if the pattern
+ * has no such run, or is not one this is sure to read right: only the
+ * top level of the pattern is looked at, and alternatives, groups,
+ * brackets and escapes other than escaped punctuation end a run.
+ */
+const char     *
+regset_literal(apr_pool_t * pool, const char *pattern)
+{
+    const char     *p = pattern;
+    char           *run,
+                   *best;
+    size_t          len = 0,
+                    best_len = 0;
+
+    run = apr_palloc(pool, strlen(pattern) + 1);
+    best = apr_palloc(pool, strlen(pattern) + 1);
+
+    while (*p) {
+        const char     *q;
+        int             c = -1,
+                        optional = 0,
+                        repeated = 0;
+
+        switch (*p) {
+        case '(':
+            if (!(q = regset_skip_group(p)))
+                return NULL;
+            break;
+        case '[':
+            if (!(q = regset_skip_bracket(p)))
+                return NULL;
+            break;
+        case '.':
+        case '^':
+        case '$':
+            q = p + 1;
+            break;
+        case '\\':
+            if (!p[1])
+                return NULL;
+
+            if (REGSET_LITERAL_ESCAPE(p[1]))
+                c = (unsigned char) p[1];
+
+            q = p + 2;
+            break;
+        case '|':
+        case ')':
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+        case '}':
+            return NULL;
+        default:
+            c = (unsigned char) *p;
+            q = p + 1;
+        }
+
+        /*
+         * whatever quantifies the atom
+         */
+        for (;; repeated = 1) {
+            if (*q == '*' || *q == '?') {
+                optional = 1;
+                q++;
+            } else if (*q == '+') {
+                q++;
+            } else if (*q == '{') {
+                char           *end;
+
+                if (!isdigit((unsigned char) q[1]))
+                    return NULL;
+
+                if (!strtol(q + 1, &end, 10))
+                    optional = 1;
+
+                if (*end == ',') {
+                    end++;
+                    while (isdigit((unsigned char) *end))
+                        end++;
+                }
+
+                if (*end != '}')
+                    return NULL;
+
+                q = end + 1;
+            } else
+                break;
+        }
+
+        if (c != -1 && !optional)
+            run[len++] = c;
+
+        if (c == -1 || optional || repeated) {
+            if (len > best_len) {
+                memcpy(best, run, len);
+                best_len = len;
+            }
+
+            len = 0;
+        }
+
+        p = q;
+    }
+
+    if (len > best_len) {
+        memcpy(best, run, len);
+        best_len = len;
+    }
+
+    if (!best_len)
+        return NULL;
+
+    best[best_len] = '\0';
+    return best;
+}
+
+regset_t       *
+regset_make(apr_pool_t * pool)
+{
+    regset_t       *rs;
+
+    rs = apr_pcalloc(pool, sizeof(regset_t));
+    rs->pool = pool;
+    rs->nfa = apr_array_make(pool, 64, sizeof(regset_nstate_t));
+    rs->classes = apr_array_make(pool, 16, sizeof(regset_class_t));
+    rs->starts = apr_array_make(pool, 4, sizeof(int));
+    rs->fallback = apr_array_make(pool, 1, sizeof(regset_fallback_t));
+    rs->literals = apr_array_make(pool, 4, sizeof(const char *));
+
+    return rs;
+}
+
+/*
+ * add a pattern to the set, regex being its regcomp()'ed form (with
+ * REG_EXTENDED), literal what regset_literal() found in it and id what
+ * regset_match_all() reports it as. Returns 1 if the automaton covers it,
+ * 0 if it is left to regexec().
+ */
+int
+regset_add(regset_t * rs, const char *pattern, const regex_t * regex,
+           const char *literal, uint32_t id)
+{
+    regset_parser_t ps;
+    regset_frag_t   f;
+    regset_fallback_t *fallback;
+    int             nnfa,
+                    nclasses,
+                    match = -1;
+
+    nnfa = rs->nfa->nelts;
+    nclasses = rs->classes->nelts;
+
+    ps.rs = rs;
+    ps.pattern = pattern;
+    ps.p = pattern;
+    ps.depth = 0;
+
+    /*
+     * every pattern ends in a state of its own, which remembers its id
+     */
+    if (regset_parse_alt(&ps, &f) == -1 || *ps.p ||
+        (match = regset_state(rs, REGSET_MATCH, -1, -1, (int) id)) == -1) {
+        /*
+         * forget whatever was built of it
+         */
+        rs->nfa->nelts = nnfa;
+        rs->classes->nelts = nclasses;
+
+        fallback = apr_array_push(rs->fallback);
+        fallback->regex = regex;
+        fallback->literal = literal;
+        fallback->id = id;
+        return 0;
+    }
+
+    NSTATE(rs, f.end)->out = match;
+    *(int *) apr_array_push(rs->starts) = f.start;
+
+    if (literal)
+        *(const char **) apr_array_push(rs->literals) = literal;
+    else
+        rs->unfiltered++;
+
+    return 1;
+}
+
+static void
+regset_scratch_init(apr_pool_t * pool, regset_t * rs, regset_scratch_t * sc)
+{
+    int             n = rs->nstates + rs->starts->nelts;
+
+    sc->mark = apr_pcalloc(pool, sizeof(unsigned) * rs->nstates);
+    sc->gen = 0;
+    sc->stack = apr_palloc(pool, sizeof(int) * n);
+    sc->from = apr_palloc(pool, sizeof(int) * n);
+    sc->cur = apr_palloc(pool, sizeof(int) * n);
+    sc->nxt = apr_palloc(pool, sizeof(int) * n);
+}
+
+/*
+ * the scratch space and buckets of a cache, in one block of the
+ * process' own memory. Returns -1 if there is no memory for it.
+ */
+static int
+regset_cache_alloc(regset_t * rs, regset_cache_t * c)
+{
+    regset_scratch_t *sc = &c->scratch;
+    int             n = rs->nstates + rs->starts->nelts;
+
+    c->buckets = calloc(1, sizeof(regset_dstate_t *) * REGSET_BUCKETS +
+                        sizeof(unsigned) * rs->nstates +
+                        sizeof(int) * n * 4);
+
+    if (!c->buckets)
+        return -1;
+
+    sc->mark = (unsigned *) (c->buckets + REGSET_BUCKETS);
+    sc->gen = 0;
+    sc->stack = (int *) (sc->mark + rs->nstates);
+    sc->from = sc->stack + n;
+    sc->cur = sc->from + n;
+    sc->nxt = sc->cur + n;
+
+    return 0;
+}
+
+/*
+ * empty the cache, setting its states aside in retired. Lock held.
+ */
+static void
+regset_dfa_retire(regset_cache_t * c)
+{
+    regset_dstate_t *d,
+                   *next;
+    int             i;
+
+    for (i = 0; i < REGSET_BUCKETS; i++) {
+        for (d = c->buckets[i]; d; d = next) {
+            next = d->hnext;
+            d->hnext = c->retired;
+            c->retired = d;
+        }
+
+        c->buckets[i] = NULL;
+    }
+
+    if ((d = c->initial)) {
+        d->hnext = c->retired;
+        c->retired = d;
+    }
+
+    /*
+     * threads coming in from now on must not find the old first state
+     */
+    apr_atomic_casptr((volatile void **) &c->initial, NULL, d);
+    c->ndstates = 0;
+}
+
+/*
+ * free the retired states. Lock held, and no thread in the cache.
+ */
+static void
+regset_dfa_free(regset_cache_t * c)
+{
+    regset_dstate_t *d,
+                   *next;
+
+    for (d = c->retired; d; d = next) {
+        next = d->hnext;
+        free(d);
+    }
+
+    c->retired = NULL;
+}
+
+static apr_status_t
+regset_cleanup(void *data)
+{
+    regset_cache_t *c = data;
+
+    if (c->buckets) {
+        regset_dfa_retire(c);
+        regset_dfa_free(c);
+        free(c->buckets);
+        c->buckets = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * give the regset a cache of its own for this process, allocated from
+ * (and freed with) pool. Whatever cache it had is left to its own pool.
+ * The process finishing a regset gets one, a process going on to match
+ * a regset built by another calls this before it does.
+ */
+int
+regset_attach(regset_t * rs, apr_pool_t * pool)
+{
+    regset_cache_t *c;
+
+    c = apr_pcalloc(pool, sizeof(regset_cache_t));
+
+#ifdef APR_HAS_THREADS
+    if (apr_thread_mutex_create(&c->lock, APR_THREAD_MUTEX_DEFAULT,
+                                pool) != APR_SUCCESS)
+        return -1;
+#endif
+
+    apr_pool_cleanup_register(pool, c, regset_cleanup,
+                              apr_pool_cleanup_null);
+
+    rs->cache = c;
+    return 0;
+}
+
+/*
+ * done adding patterns. Splits the bytes into the classes no pattern
+ * tells apart, so that a cached state has a transition per class rather
+ * than per byte.
+ */
+int
+regset_finish(regset_t * rs)
+{
+    int             i,
+                    b,
+                    k;
+
+    rs->states = (regset_nstate_t *) rs->nfa->elts;
+    rs->nstates = rs->nfa->nelts;
+    rs->cls = (regset_class_t *) rs->classes->elts;
+
+    memset(rs->byteclass, 0, sizeof(rs->byteclass));
+    rs->nclasses = 1;
+
+    for (i = 0; i < rs->classes->nelts; i++) {
+        int             split[256][2];
+        int             n = 0;
+
+        for (k = 0; k < rs->nclasses; k++)
+            split[k][0] = split[k][1] = -1;
+
+        for (b = 0; b < 256; b++) {
+            int             in = CLASS_TEST(&rs->cls[i], b) != 0;
+            int            *id = &split[rs->byteclass[b]][in];
+
+            if (*id == -1)
+                *id = n++;
+
+            rs->byteclass[b] = *id;
+        }
+
+        rs->nclasses = n;
+    }
+
+    for (b = 255; b >= 0; b--)
+        rs->rep[rs->byteclass[b]] = b;
+
+    return regset_attach(rs, rs->pool);
+}
+
+#define REGSET_PUSH(x) do { \
+        int _x = (x); \
+        if (_x >= 0 && sc->mark[_x] != sc->gen) { \
+            sc->mark[_x] = sc->gen; \
+            sc->stack[sp++] = _x; \
+        } \
+    } while (0)
+
+/*
+ * the states from can reach without reading anything. Only the ones that
+ * read something, match, or wait for the end of the string are kept.
+ */
+static int
+regset_closure(const regset_t * rs, regset_scratch_t * sc, const int *from,
+               int nfrom, int bol, int eol, int *out)
+{
+    int             sp = 0,
+                    n = 0,
+                    i;
+
+    if (++sc->gen == 0) {
+        memset(sc->mark, 0, sizeof(unsigned) * rs->nstates);
+        sc->gen = 1;
+    }
+
+    for (i = nfrom - 1; i >= 0; i--)
+        REGSET_PUSH(from[i]);
+
+    while (sp) {
+        int             s = sc->stack[--sp];
+        const regset_nstate_t *st = &rs->states[s];
+
+        switch (st->type) {
+        case REGSET_SPLIT:
+            REGSET_PUSH(st->out1);
+            REGSET_PUSH(st->out);
+            break;
+        case REGSET_EMPTY:
+            REGSET_PUSH(st->out);
+            break;
+        case REGSET_BOL:
+            if (bol)
+                REGSET_PUSH(st->out);
+            break;
+        case REGSET_EOL:
+            if (eol)
+                REGSET_PUSH(st->out);
+            else
+                out[n++] = s;
+            break;
+        default:
+            out[n++] = s;
+            break;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * the states after reading a byte of class k. Every pattern may also
+ * start matching at the next position, so the starts always come along.
+ */
+static int
+regset_step(const regset_t * rs, regset_scratch_t * sc, const int *set,
+            int n, int k, int *out)
+{
+    int             nfrom = 0,
+                    i;
+
+    for (i = 0; i < n; i++) {
+        const regset_nstate_t *st = &rs->states[set[i]];
+
+        if (st->type == REGSET_CHAR &&
+            CLASS_TEST(&rs->cls[st->cls], rs->rep[k]))
+            sc->from[nfrom++] = st->out;
+    }
+
+    for (i = 0; i < rs->starts->nelts; i++)
+        sc->from[nfrom++] = ((int *) rs->starts->elts)[i];
+
+    return regset_closure(rs, sc, sc->from, nfrom, 0, 0, out);
+}
+
+/*
+ * the patterns matched in a set of states, their ids go to ids (if not
+ * NULL)
+ */
+static int
+regset_accepts(const regset_t * rs, const int *set, int n, uint32_t * ids)
+{
+    int             i,
+                    found = 0;
+
+    for (i = 0; i < n; i++) {
+        if (rs->states[set[i]].type != REGSET_MATCH)
+            continue;
+
+        if (!ids)
+            return 1;
+
+        REGSET_SET(ids, (uint32_t) rs->states[set[i]].cls);
+        found = 1;
+    }
+
+    return found;
+}
+
+/*
+ * the states the string would match with if it ended with this set of
+ * states (besides the ones in it), worked out in sc->nxt
+ */
+static int
+regset_end_states(const regset_t * rs, regset_scratch_t * sc,
+                  const int *set, int n, int bol)
+{
+    int             nfrom = 0,
+                    i;
+
+    for (i = 0; i < n; i++)
+        if (rs->states[set[i]].type == REGSET_EOL)
+            sc->from[nfrom++] = rs->states[set[i]].out;
+
+    if (!nfrom)
+        return 0;
+
+    return regset_closure(rs, sc, sc->from, nfrom, bol, 1, sc->nxt);
+}
+
+/*
+ * would the string match if it ended with this set of states
+ */
+static int
+regset_accepts_end(const regset_t * rs, regset_scratch_t * sc,
+                   const int *set, int n, int bol, uint32_t * ids)
+{
+    int             found;
+
+    if ((found = regset_accepts(rs, set, n, ids)) && !ids)
+        return 1;
+
+    n = regset_end_states(rs, sc, set, n, bol);
+
+    return regset_accepts(rs, sc->nxt, n, ids) | found;
+}
+
+/*
+ * run the NFA itself, from set on. Without ids it stops at the first
+ * match, otherwise it goes to the end of the string setting the id of
+ * every pattern found.
+ */
+static int
+regset_nfa_match(const regset_t * rs, regset_scratch_t * sc,
+                 const int *set, int n, const unsigned char *s, int bol,
+                 uint32_t * ids)
+{
+    int            *cur = sc->cur;
+    int            *nxt = sc->nxt;
+    int             found = 0;
+
+    if (set != cur)
+        memcpy(cur, set, sizeof(int) * n);
+
+    for (;; s++) {
+        int            *tmp;
+
+        if (!*s)
+            return regset_accepts_end(rs, sc, cur, n, bol, ids) | found;
+
+        if (regset_accepts(rs, cur, n, ids)) {
+            if (!ids)
+                return 1;
+
+            found = 1;
+        }
+
+        n = regset_step(rs, sc, cur, n, rs->byteclass[*s], nxt);
+        tmp = cur;
+        cur = nxt;
+        nxt = tmp;
+        bol = 0;
+
+        /*
+         * accepts_end() works in nxt
+         */
+        sc->cur = cur;
+        sc->nxt = nxt;
+    }
+}
+
+static int
+regset_cmp_int(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+static regset_dstate_t *
+regset_dstate_new(regset_t * rs, regset_scratch_t * sc, int *set, int n,
+                  int bol)
+{
+    regset_dstate_t *d;
+    int             nend,
+                    nids = 0,
+                    nids_end,
+                    i;
+
+    /*
+     * the states it would take at the end of the string, and how many
+     * patterns match in either
+     */
+    nend = regset_end_states(rs, sc, set, n, bol);
+
+    for (i = 0; i < n; i++)
+        nids += rs->states[set[i]].type == REGSET_MATCH;
+
+    for (i = 0, nids_end = nids; i < nend; i++)
+        nids_end += rs->states[sc->nxt[i]].type == REGSET_MATCH;
+
+    d = malloc(sizeof(regset_dstate_t) +
+               sizeof(regset_dstate_t *) * rs->nclasses + sizeof(int) * n +
+               sizeof(uint32_t) * nids_end);
+
+    if (!d)
+        return NULL;
+
+    d->next = (regset_dstate_t * volatile *) (d + 1);
+    d->set = (int *) (d->next + rs->nclasses);
+    d->ids = (uint32_t *) (d->set + n);
+    d->n = n;
+    memset((void *) d->next, 0, sizeof(regset_dstate_t *) * rs->nclasses);
+    memcpy(d->set, set, sizeof(int) * n);
+
+    d->nids = d->nids_end = 0;
+
+    for (i = 0; i < n; i++)
+        if (rs->states[set[i]].type == REGSET_MATCH)
+            d->ids[d->nids_end++] = rs->states[set[i]].cls;
+
+    d->nids = d->nids_end;
+
+    for (i = 0; i < nend; i++)
+        if (rs->states[sc->nxt[i]].type == REGSET_MATCH)
+            d->ids[d->nids_end++] = rs->states[sc->nxt[i]].cls;
+
+    d->accept = d->nids != 0;
+    d->accept_end = d->nids_end != 0;
+    d->hnext = NULL;
+    d->hash = 0;
+
+    return d;
+}
+
+/*
+ * the cached state for a set of NFA states, NULL when the cache is full
+ */
+static regset_dstate_t *
+regset_dstate_get(regset_t * rs, regset_cache_t * c, int *set, int n)
+{
+    regset_dstate_t *d;
+    unsigned        hash = 2166136261U;
+    int             i;
+
+    qsort(set, n, sizeof(int), regset_cmp_int);
+
+    for (i = 0; i < n; i++)
+        hash = (hash ^ (unsigned) set[i]) * 16777619U;
+
+    for (d = c->buckets[hash % REGSET_BUCKETS]; d; d = d->hnext)
+        if (d->hash == hash && d->n == n &&
+            !memcmp(d->set, set, sizeof(int) * n))
+            return d;
+
+    if (c->ndstates >= REGSET_MAX_DFA ||
+        !(d = regset_dstate_new(rs, &c->scratch, set, n, 0)))
+        return NULL;
+
+    d->hash = hash;
+    d->hnext = c->buckets[hash % REGSET_BUCKETS];
+    c->buckets[hash % REGSET_BUCKETS] = d;
+    c->ndstates++;
+
+    return d;
+}
+
+/*
+ * run the NFA alone, with scratch space from pool
+ */
+static int
+regset_nfa_run(regset_t * rs, const unsigned char *s, apr_pool_t * pool,
+               uint32_t * ids)
+{
+    regset_scratch_t sc;
+    int             n;
+
+    regset_scratch_init(pool, rs, &sc);
+    memcpy(sc.from, rs->starts->elts, sizeof(int) * rs->starts->nelts);
+    n = regset_closure(rs, &sc, sc.from, rs->starts->nelts, 1, 0, sc.cur);
+
+    return regset_nfa_match(rs, &sc, sc.cur, n, s, 1, ids);
+}
+
+/*
+ * the first state, made if no thread did yet. NULL if there is no memory
+ * for it.
+ */
+static regset_dstate_t *
+regset_dfa_start(regset_t * rs, regset_cache_t * c)
+{
+    regset_scratch_t *sc = &c->scratch;
+    regset_dstate_t *d;
+    int             n;
+
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_lock(c->lock);
+#endif
+
+    if (!(d = c->initial) &&
+        (c->buckets || regset_cache_alloc(rs, c) == 0)) {
+        memcpy(sc->from, rs->starts->elts, sizeof(int) * rs->starts->nelts);
+        n = regset_closure(rs, sc, sc->from, rs->starts->nelts, 1, 0,
+                           sc->cur);
+
+        /*
+         * the first state is the only one at the start of the string, it
+         * is kept out of the cache.
+         */
+        if ((d = regset_dstate_new(rs, sc, sc->cur, n, 1)))
+            apr_atomic_casptr((volatile void **) &c->initial, d, NULL);
+    }
+
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(c->lock);
+#endif
+
+    return d;
+}
+
+/*
+ * the state d goes to on class cls, made if no thread did yet. A full
+ * cache is started over, unless the states of the last time are still
+ * retired: then it returns NULL, leaving the n NFA states to go on with
+ * in sc, which is set up from pool.
+ */
+static regset_dstate_t *
+regset_dfa_next(regset_t * rs, regset_cache_t * c, regset_dstate_t * d,
+                int cls, apr_pool_t * pool, regset_scratch_t * sc, int *n)
+{
+    regset_dstate_t *next;
+
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_lock(c->lock);
+#endif
+
+    if (!(next = d->next[cls])) {
+        *n = regset_step(rs, &c->scratch, d->set, d->n, cls,
+                         c->scratch.cur);
+
+        if (!(next = regset_dstate_get(rs, c, c->scratch.cur, *n)) &&
+            c->ndstates >= REGSET_MAX_DFA && !c->retired) {
+            regset_dfa_retire(c);
+            next = regset_dstate_get(rs, c, c->scratch.cur, *n);
+        }
+
+        /*
+         * d may be retired by now, pointing it at a state of the new
+         * cache does no harm: nothing there leads back to the old one
+         */
+        if (next)
+            apr_atomic_casptr((volatile void **) &d->next[cls], next, NULL);
+        else {
+            regset_scratch_init(pool, rs, sc);
+            memcpy(sc->cur, c->scratch.cur, sizeof(int) * *n);
+        }
+    }
+
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(c->lock);
+#endif
+
+    return next;
+}
+
+/*
+ * free the retired states if no thread is in the cache any more. One
+ * coming in now starts from the new first state and never gets to them.
+ */
+static void
+regset_dfa_reclaim(regset_cache_t * c)
+{
+#ifdef APR_HAS_THREADS
+    if (apr_thread_mutex_trylock(c->lock) != APR_SUCCESS)
+        return;
+#endif
+
+    if (apr_atomic_read32(&c->readers) == 0)
+        regset_dfa_free(c);
+
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(c->lock);
+#endif
+}
+
+/*
+ * run the cached DFA, adding the states it is missing on the way. When
+ * the cache has no room left the rest of the string is run on the NFA.
+ * ids as for regset_nfa_match(). The caller is counted in readers.
+ */
+static int
+regset_dfa_match(regset_t * rs, regset_cache_t * c, const unsigned char *s,
+                 apr_pool_t * pool, uint32_t * ids)
+{
+    regset_scratch_t sc;
+    regset_dstate_t *d,
+                   *next;
+    int             n,
+                    i,
+                    found = 0;
+
+    if (!(d = c->initial) && !(d = regset_dfa_start(rs, c)))
+        return regset_nfa_run(rs, s, pool, ids);
+
+    for (;; s++) {
+        if (!*s) {
+            if (!ids)
+                return d->accept_end;
+
+            for (i = 0; i < d->nids_end; i++)
+                REGSET_SET(ids, d->ids[i]);
+
+            return found | d->accept_end;
+        }
+
+        if (d->accept) {
+            if (!ids)
+                return 1;
+
+            for (i = 0; i < d->nids; i++)
+                REGSET_SET(ids, d->ids[i]);
+
+            found = 1;
+        }
+
+        if (!(next = d->next[rs->byteclass[*s]]) &&
+            !(next = regset_dfa_next(rs, c, d, rs->byteclass[*s], pool,
+                                     &sc, &n)))
+            return regset_nfa_match(rs, &sc, sc.cur, n, s + 1, 0,
+                                    ids) | found;
+
+        d = next;
+    }
+}
+
+/*
+ * can any pattern of the automaton match str, going by whether str holds
+ * one of their literals
+ */
+static int
+regset_prefilter(regset_t * rs, const char *str)
+{
+    int             i;
+
+    if (rs->unfiltered || rs->literals->nelts > REGSET_MAX_LITERALS)
+        return 1;
+
+    for (i = 0; i < rs->literals->nelts; i++)
+        if (strstr(str, ((const char **) rs->literals->elts)[i]))
+            return 1;
+
+    return 0;
+}
+
+/*
+ * does any pattern of the set match somewhere in str, or with ids, which
+ * ones. pool is only used for scratch space when the cache can't be.
+ */
+static int
+regset_run(regset_t * rs, const char *str, apr_pool_t * pool,
+           uint32_t * ids)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    regset_cache_t *c = rs->cache;
+    int             found = 0,
+                    i;
+
+    if (rs->starts->nelts && regset_prefilter(rs, str)) {
+        apr_atomic_inc32(&c->readers);
+        found = regset_dfa_match(rs, c, s, pool, ids);
+
+        if (!apr_atomic_dec32(&c->readers) && c->retired)
+            regset_dfa_reclaim(c);
+
+        if (found && !ids)
+            return 1;
+    }
+
+    for (i = 0; i < rs->fallback->nelts; i++) {
+        regset_fallback_t *fallback =
+            &((regset_fallback_t *) rs->fallback->elts)[i];
+
+        if (ids && REGSET_TEST(ids, fallback->id))
+            continue;
+
+        if (fallback->literal && !strstr(str, fallback->literal))
+            continue;
+
+        if (regexec(fallback->regex, str, 0, NULL, 0) == 0) {
+            if (!ids)
+                return 1;
+
+            REGSET_SET(ids, fallback->id);
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+int
+regset_match(regset_t * rs, const char *str, apr_pool_t * pool)
+{
+    return regset_run(rs, str, pool, NULL);
+}
+
+/*
+ * set the bit of the id of every pattern matching somewhere in str in
+ * ids, which must have room for the largest of them. Returns whether
+ * there was any.
+ */
+int
+regset_match_all(regset_t * rs, const char *str, apr_pool_t * pool,
+                 uint32_t * ids)
+{
+    return regset_run(rs, str, pool, ids);
+}
@@ -0,0 +1,48 @@
+/******************************************************************************/
+/* regset.h  -- match a string against a set of regular expressions at once
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#ifndef _REGSET_H
+#define _REGSET_H
+
+#include <regex.h>
+#include "apr.h"
+#include "apr_pools.h"
+#include "apr_tables.h"
+#include "apr_thread_mutex.h"
+
+/*
+ * A regset answers "does any of these extended regular expressions match
+ * somewhere in the string" in a single pass over it. The patterns are
+ * compiled into one automaton whose deterministic states are built as
+ * strings need them and kept in a per-process cache (see regset_attach()).
+ *
+ * Patterns the automaton does not cover (back-references, word
+ * boundaries, collating elements, anything beyond 7-bit ASCII and the
+ * odd corner of the grammar) are kept with their regcomp()'ed form and
+ * run through regexec() after the automaton did not match.
+ *
+ * regset_match_all() goes on to tell which of the patterns match, by the
+ * ids they were added with.
+ *
+ * Every pattern may come with a literal it cannot match without (see
+ * regset_literal()), strings holding none of them skip the automaton and
+ * regexec() altogether.
+ *
+ * Strings are matched byte by byte, the way regexec() does in the "C"
+ * locale httpd runs in.
+ */
+typedef struct regset regset_t;
+
+regset_t *regset_make(apr_pool_t *);
+const char *regset_literal(apr_pool_t *, const char *);
+int regset_add(regset_t *, const char *, const regex_t *, const char *,
+               uint32_t);
+int regset_finish(regset_t *);
+int regset_attach(regset_t *, apr_pool_t *);
+int regset_match(regset_t *, const char *, apr_pool_t *);
+int regset_match_all(regset_t *, const char *, apr_pool_t *, uint32_t *);
+
+#endif                          /* _REGSET_H */
@@ -0,0 +1,591 @@
+/******************************************************************************/
+/* strmatch.c  -- look for many fixed strings within a string at once
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "apr_hash.h"
+#include "strmatch.h"
+
+/*
+ * set on a transition into a state one of the strings ends in (or ends
+ * in a suffix of), the rest of the entry is the offset of the row of the
+ * state.
+ */
+#define STRMATCH_ACCEPT   0x80000000U
+
+#define STRMATCH_SET(ids, id) ((ids)[(id) >> 5] |= 1U << ((id) & 31))
+
+/*
+ * a string to look for and the id it is reported with
+ */
+typedef struct strmatch_string {
+    const char     *str;
+    uint32_t        id;
+} strmatch_string_t;
+
+/*
+ * a prefix or suffix trie. Nodes are numbered breadth first and their
+ * edges laid out in the same order, sorted by label, which makes the
+ * node an edge leads to the edge's index plus one: a node is only the
+ * offset of its first edge, the edges of node n ending where those of
+ * node n + 1 start. The ids of the strings ending in a node are laid out
+ * the same way, from out[n] to out[n + 1].
+ */
+typedef struct strmatch_trie {
+    uint32_t       *first;
+    uint8_t        *labels;
+    uint32_t       *out;
+    uint32_t       *ids;
+} strmatch_trie_t;
+
+struct strmatch {
+    apr_pool_t     *pool;
+    apr_array_header_t *strings[3];
+
+    /*
+     * set by strmatch_finish(). empty holds the ids of the strings that
+     * are "", which every string matches. Bytes used by none of the
+     * contains strings all share class 0. The ids of the contains strings
+     * ending in a state are from out[state] to out[state + 1], and dict
+     * is the next state down its failure chain that has any (-1 if
+     * none).
+     */
+    apr_array_header_t *empty;
+    uint8_t         cls[256];
+    int             ncls;
+    int             nstates;
+    uint32_t       *delta;
+    uint32_t       *out;
+    uint32_t       *ids;
+    int            *dict;
+    strmatch_trie_t *prefixes;
+    strmatch_trie_t *suffixes;
+};
+
+/*
+ * a transition of the contains trie, the key of the hash it is built in
+ */
+typedef struct strmatch_edge {
+    int             state;
+    int             cls;
+} strmatch_edge_t;
+
+/*
+ * a node of a prefix or suffix trie while it is being built, its
+ * children kept sorted by label
+ */
+typedef struct strmatch_tnode strmatch_tnode_t;
+
+struct strmatch_tnode {
+    apr_array_header_t *ids;
+    int             nkids;
+    int             size;
+    uint8_t        *labels;
+    strmatch_tnode_t **kids;
+};
+
+strmatch_t     *
+strmatch_make(apr_pool_t * pool)
+{
+    strmatch_t     *sm;
+    int             i;
+
+    sm = apr_pcalloc(pool, sizeof(strmatch_t));
+    sm->pool = pool;
+
+    for (i = 0; i < 3; i++)
+        sm->strings[i] = apr_array_make(pool, 16, sizeof(strmatch_string_t));
+
+    sm->empty = apr_array_make(pool, 1, sizeof(uint32_t));
+
+    return sm;
+}
+
+/*
+ * type is one of STRMATCH_CONTAINS, STRMATCH_PREFIX or STRMATCH_SUFFIX,
+ * id what strmatch_match_all() reports the string as. The string is not
+ * copied, it is only looked at by strmatch_finish().
+ */
+void
+strmatch_add(strmatch_t * sm, const char *str, int type, uint32_t id)
+{
+    strmatch_string_t *s = apr_array_push(sm->strings[type]);
+
+    s->str = str;
+    s->id = id;
+}
+
+static int     *
+strmatch_child(apr_hash_t * edges, int state, int cls)
+{
+    strmatch_edge_t edge;
+
+    edge.state = state;
+    edge.cls = cls;
+
+    return apr_hash_get(edges, &edge, sizeof(edge));
+}
+
+static int
+strmatch_build_contains(strmatch_t * sm, apr_pool_t * tpool)
+{
+    apr_array_header_t *strings = sm->strings[STRMATCH_CONTAINS];
+    apr_hash_t     *edges;
+    uint32_t       *pos;
+    size_t          total = 1;
+    int            *accept,
+                   *fail,
+                   *queue,
+                   *ends,
+                    head,
+                    tail,
+                    i;
+
+    memset(sm->cls, 0, sizeof(sm->cls));
+    sm->ncls = 1;
+
+    for (i = 0; i < strings->nelts; i++) {
+        const unsigned char *p = (const unsigned char *)
+            ((strmatch_string_t *) strings->elts)[i].str;
+
+        for (; *p; p++, total++)
+            if (!sm->cls[*p])
+                sm->cls[*p] = sm->ncls++;
+    }
+
+    /*
+     * the trie of the strings, with its transitions in a hash until it is
+     * known how many states it has
+     */
+    edges = apr_hash_make(tpool);
+    accept = apr_pcalloc(tpool, sizeof(int) * total);
+    ends = apr_palloc(tpool, sizeof(int) * strings->nelts);
+    sm->nstates = 1;
+
+    for (i = 0; i < strings->nelts; i++) {
+        const unsigned char *p = (const unsigned char *)
+            ((strmatch_string_t *) strings->elts)[i].str;
+        int             state = 0;
+
+        for (; *p; p++) {
+            int            *child = strmatch_child(edges, state, sm->cls[*p]);
+
+            if (!child) {
+                strmatch_edge_t *edge;
+
+                edge = apr_palloc(tpool, sizeof(strmatch_edge_t));
+                edge->state = state;
+                edge->cls = sm->cls[*p];
+
+                child = apr_palloc(tpool, sizeof(int));
+                *child = sm->nstates++;
+
+                apr_hash_set(edges, edge, sizeof(strmatch_edge_t), child);
+            }
+
+            state = *child;
+        }
+
+        accept[state] = 1;
+        ends[i] = state;
+    }
+
+    if ((size_t) sm->nstates * sm->ncls >= STRMATCH_ACCEPT)
+        return -1;
+
+    /*
+     * the ids of the strings ending in each state, counted first
+     */
+    sm->out = apr_pcalloc(sm->pool, sizeof(uint32_t) * (sm->nstates + 1));
+    sm->ids = apr_palloc(sm->pool, sizeof(uint32_t) * strings->nelts);
+
+    for (i = 0; i < strings->nelts; i++)
+        sm->out[ends[i] + 1]++;
+
+    for (i = 0; i < sm->nstates; i++)
+        sm->out[i + 1] += sm->out[i];
+
+    pos = apr_pmemdup(tpool, sm->out, sizeof(uint32_t) * sm->nstates);
+
+    for (i = 0; i < strings->nelts; i++)
+        sm->ids[pos[ends[i]]++] = ((strmatch_string_t *) strings->elts)[i].id;
+
+    sm->delta = apr_palloc(sm->pool,
+                           sizeof(uint32_t) * sm->nstates * sm->ncls);
+    sm->dict = apr_palloc(sm->pool, sizeof(int) * sm->nstates);
+    fail = apr_palloc(tpool, sizeof(int) * sm->nstates);
+    queue = apr_palloc(tpool, sizeof(int) * sm->nstates);
+
+    /*
+     * fill the table breadth first: a state's failure state is shallower,
+     * so its row is complete by the time the state's own row copies from
+     * it.
+     */
+    head = tail = 0;
+    queue[tail++] = 0;
+    fail[0] = 0;
+    sm->dict[0] = -1;
+
+    while (head < tail) {
+        int             state = queue[head++];
+        uint32_t       *row = &sm->delta[state * sm->ncls];
+        uint32_t       *fail_row = &sm->delta[fail[state] * sm->ncls];
+        int             c;
+
+        for (c = 0; c < sm->ncls; c++) {
+            int            *child = strmatch_child(edges, state, c);
+
+            if (!child) {
+                row[c] = state ? fail_row[c] : 0;
+                continue;
+            }
+
+            fail[*child] = state ?
+                (fail_row[c] & ~STRMATCH_ACCEPT) / sm->ncls : 0;
+            accept[*child] |= accept[fail[*child]];
+            sm->dict[*child] = sm->out[fail[*child]] !=
+                sm->out[fail[*child] + 1] ? fail[*child] :
+                sm->dict[fail[*child]];
+
+            row[c] = *child * sm->ncls;
+
+            if (accept[*child])
+                row[c] |= STRMATCH_ACCEPT;
+
+            queue[tail++] = *child;
+        }
+    }
+
+    return 0;
+}
+
+static strmatch_tnode_t *
+strmatch_tnode_kid(apr_pool_t * tpool, strmatch_tnode_t * node, uint8_t c)
+{
+    strmatch_tnode_t *kid;
+    int             lo = 0,
+                    hi = node->nkids;
+
+    while (lo < hi) {
+        int             mid = (lo + hi) / 2;
+
+        if (node->labels[mid] < c)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < node->nkids && node->labels[lo] == c)
+        return node->kids[lo];
+
+    if (node->nkids == node->size) {
+        uint8_t        *labels;
+        strmatch_tnode_t **kids;
+
+        node->size = node->size ? node->size * 2 : 2;
+        labels = apr_palloc(tpool, node->size);
+        kids = apr_palloc(tpool, sizeof(strmatch_tnode_t *) * node->size);
+
+        if (node->nkids) {
+            memcpy(labels, node->labels, node->nkids);
+            memcpy(kids, node->kids,
+                   sizeof(strmatch_tnode_t *) * node->nkids);
+        }
+
+        node->labels = labels;
+        node->kids = kids;
+    }
+
+    memmove(&node->labels[lo + 1], &node->labels[lo], node->nkids - lo);
+    memmove(&node->kids[lo + 1], &node->kids[lo],
+            sizeof(strmatch_tnode_t *) * (node->nkids - lo));
+
+    kid = apr_pcalloc(tpool, sizeof(strmatch_tnode_t));
+    node->labels[lo] = c;
+    node->kids[lo] = kid;
+    node->nkids++;
+
+    return kid;
+}
+
+/*
+ * the trie of the prefixes, or of the reversed suffixes
+ */
+static strmatch_trie_t *
+strmatch_build_trie(strmatch_t * sm, apr_pool_t * tpool, int type)
+{
+    apr_array_header_t *strings = sm->strings[type];
+    strmatch_tnode_t *root,
+                  **queue;
+    strmatch_trie_t *trie;
+    int             nnodes = 1,
+                    head,
+                    tail,
+                    nedges,
+                    nids,
+                    i;
+
+    root = apr_pcalloc(tpool, sizeof(strmatch_tnode_t));
+
+    for (i = 0; i < strings->nelts; i++) {
+        strmatch_string_t *s = &((strmatch_string_t *) strings->elts)[i];
+        const unsigned char *str = (const unsigned char *) s->str;
+        strmatch_tnode_t *node = root;
+        size_t          len = strlen(s->str),
+                        n;
+
+        for (n = 0; n < len; n++)
+            node = strmatch_tnode_kid(tpool, node,
+                                      type == STRMATCH_PREFIX ?
+                                      str[n] : str[len - n - 1]);
+
+        if (!node->ids)
+            node->ids = apr_array_make(tpool, 1, sizeof(uint32_t));
+
+        *(uint32_t *) apr_array_push(node->ids) = s->id;
+        nnodes += len;
+    }
+
+    /*
+     * number the nodes
+     */
+    trie = apr_palloc(sm->pool, sizeof(strmatch_trie_t));
+    queue = apr_palloc(tpool, sizeof(strmatch_tnode_t *) * nnodes);
+
+    head = tail = 0;
+    queue[tail++] = root;
+
+    while (head < tail) {
+        strmatch_tnode_t *node = queue[head++];
+
+        for (i = 0; i < node->nkids; i++)
+            queue[tail++] = node->kids[i];
+    }
+
+    trie->first = apr_palloc(sm->pool, sizeof(uint32_t) * (tail + 1));
+    trie->labels = apr_palloc(sm->pool, tail);
+    trie->out = apr_palloc(sm->pool, sizeof(uint32_t) * (tail + 1));
+    trie->ids = apr_palloc(sm->pool, sizeof(uint32_t) * strings->nelts);
+
+    for (head = 0, nedges = 0, nids = 0; head < tail; head++) {
+        strmatch_tnode_t *node = queue[head];
+
+        trie->first[head] = nedges;
+        trie->out[head] = nids;
+
+        if (node->nkids)
+            memcpy(&trie->labels[nedges], node->labels, node->nkids);
+
+        if (node->ids) {
+            memcpy(&trie->ids[nids], node->ids->elts,
+                   sizeof(uint32_t) * node->ids->nelts);
+            nids += node->ids->nelts;
+        }
+
+        nedges += node->nkids;
+    }
+
+    trie->first[tail] = nedges;
+    trie->out[tail] = nids;
+
+    return trie;
+}
+
+/*
+ * build the automatons once every string has been added. Returns -1 if
+ * they are too big to be built, the strings are then best looked for one
+ * by one.
+ */
+int
+strmatch_finish(strmatch_t * sm)
+{
+    apr_pool_t     *tpool;
+    int             type,
+                    i,
+                    n,
+                    ret = 0;
+
+    /*
+     * "" is in every string, it is kept out of the automatons
+     */
+    for (type = 0; type < 3; type++) {
+        strmatch_string_t *strings =
+            (strmatch_string_t *) sm->strings[type]->elts;
+
+        for (i = 0, n = 0; i < sm->strings[type]->nelts; i++) {
+            if (!*strings[i].str)
+                *(uint32_t *) apr_array_push(sm->empty) = strings[i].id;
+            else
+                strings[n++] = strings[i];
+        }
+
+        sm->strings[type]->nelts = n;
+    }
+
+    if (apr_pool_create(&tpool, sm->pool) != APR_SUCCESS)
+        return -1;
+
+    if (sm->strings[STRMATCH_CONTAINS]->nelts)
+        ret = strmatch_build_contains(sm, tpool);
+
+    if (!ret && sm->strings[STRMATCH_PREFIX]->nelts)
+        sm->prefixes = strmatch_build_trie(sm, tpool, STRMATCH_PREFIX);
+
+    if (!ret && sm->strings[STRMATCH_SUFFIX]->nelts)
+        sm->suffixes = strmatch_build_trie(sm, tpool, STRMATCH_SUFFIX);
+
+    apr_pool_destroy(tpool);
+    return ret;
+}
+
+/*
+ * walk a trie over the len bytes of str, from the last one backwards if
+ * reverse is set. Without ids it returns 1 as soon as a string ends,
+ * otherwise it sets the bit of every string's id on the way.
+ */
+static int
+strmatch_walk(const strmatch_trie_t * trie, const unsigned char *str,
+              size_t len, int reverse, uint32_t * ids)
+{
+    uint32_t        node = 0;
+    size_t          n;
+    int             found = 0;
+
+    for (n = 0;; n++) {
+        uint32_t        lo,
+                        hi,
+                        last;
+        unsigned char   c;
+
+        if (trie->out[node] != trie->out[node + 1]) {
+            if (!ids)
+                return 1;
+
+            for (lo = trie->out[node]; lo < trie->out[node + 1]; lo++)
+                STRMATCH_SET(ids, trie->ids[lo]);
+
+            found = 1;
+        }
+
+        if (n == len)
+            return found;
+
+        c = reverse ? str[len - n - 1] : str[n];
+        lo = trie->first[node];
+        hi = last = trie->first[node + 1];
+
+        while (lo < hi) {
+            uint32_t        mid = (lo + hi) / 2;
+
+            if (trie->labels[mid] < c)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo == last || trie->labels[lo] != c)
+            return found;
+
+        node = lo + 1;
+    }
+}
+
+/*
+ * does str contain, start with or end with any of the strings
+ */
+int
+strmatch_match(const strmatch_t * sm, const char *str)
+{
+    const unsigned char *p = (const unsigned char *) str;
+    size_t          len;
+
+    if (sm->empty->nelts)
+        return 1;
+
+    if (sm->prefixes || sm->suffixes) {
+        len = strlen(str);
+
+        if (sm->prefixes && strmatch_walk(sm->prefixes, p, len, 0, NULL))
+            return 1;
+
+        if (sm->suffixes && strmatch_walk(sm->suffixes, p, len, 1, NULL))
+            return 1;
+    }
+
+    if (sm->delta) {
+        uint32_t        state = 0;
+
+        for (; *p; p++) {
+            state = sm->delta[(state & ~STRMATCH_ACCEPT) + sm->cls[*p]];
+
+            if (state & STRMATCH_ACCEPT)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * set the bit of the id of every string str contains, starts with or ends
+ * with in ids, which must have room for the largest of them. Returns
+ * whether there was any.
+ */
+int
+strmatch_match_all(const strmatch_t * sm, const char *str, uint32_t * ids)
+{
+    const unsigned char *p = (const unsigned char *) str;
+    int             found = 0,
+                    i;
+
+    for (i = 0; i < sm->empty->nelts; i++) {
+        STRMATCH_SET(ids, ((uint32_t *) sm->empty->elts)[i]);
+        found = 1;
+    }
+
+    if (sm->prefixes || sm->suffixes) {
+        size_t          len = strlen(str);
+
+        if (sm->prefixes)
+            found |= strmatch_walk(sm->prefixes, p, len, 0, ids);
+
+        if (sm->suffixes)
+            found |= strmatch_walk(sm->suffixes, p, len, 1, ids);
+    }
+
+    if (sm->delta) {
+        uint32_t        state = 0;
+
+        for (; *p; p++) {
+            int             s;
+
+            state = sm->delta[(state & ~STRMATCH_ACCEPT) + sm->cls[*p]];
+
+            if (!(state & STRMATCH_ACCEPT))
+                continue;
+
+            /*
+             * the strings ending here are the state's own and those of
+             * the states down its failure chain
+             */
+            s = (state & ~STRMATCH_ACCEPT) / sm->ncls;
+
+            if (sm->out[s] == sm->out[s + 1])
+                s = sm->dict[s];
+
+            for (; s != -1; s = sm->dict[s]) {
+                uint32_t        o;
+
+                for (o = sm->out[s]; o < sm->out[s + 1]; o++)
+                    STRMATCH_SET(ids, sm->ids[o]);
+            }
+
+            found = 1;
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,43 @@
+/******************************************************************************/
+/* strmatch.h  -- look for many fixed strings within a string at once
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#ifndef _STRMATCH_H
+#define _STRMATCH_H
+
+#include "apr.h"
+#include "apr_pools.h"
+#include "apr_tables.h"
+
+/*
+ * A strmatch answers "does this string contain, start with or end with
+ * any of these strings" in a single pass over it, however many there
+ * are.
+ *
+ * Strings to be looked for anywhere are compiled into an Aho-Corasick
+ * automaton whose transitions are laid out as one flat table, a row per
+ * state and a column per class of bytes telling the strings apart, so a
+ * step is a single lookup. Prefixes and suffixes (the latter reversed)
+ * go into byte tries stored breadth first, a node being no more than
+ * the offset of its sorted edge labels.
+ *
+ * strmatch_match_all() goes on to tell which of them are there, by the
+ * ids they were added with.
+ *
+ * Strings are compared byte by byte, case sensitively.
+ */
+#define STRMATCH_CONTAINS 0
+#define STRMATCH_PREFIX   1
+#define STRMATCH_SUFFIX   2
+
+typedef struct strmatch strmatch_t;
+
+strmatch_t *strmatch_make(apr_pool_t *);
+void strmatch_add(strmatch_t *, const char *, int, uint32_t);
+int strmatch_finish(strmatch_t *);
+int strmatch_match(const strmatch_t *, const char *);
+int strmatch_match_all(const strmatch_t *, const char *, uint32_t *);
+
+#endif                          /* _STRMATCH_H */
@@ -0,0 +1,112 @@
+/******************************************************************************/
+/* strset.c  -- flat sets of strings probed with a precomputed hash
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#include <string.h>
+#include "strset.h"
+
+typedef struct strset_slot {
+    uint32_t        hash;
+    uint32_t        len;
+    const char     *str;
+    void           *data;
+} strset_slot_t;
+
+struct strset {
+    uint32_t        mask;
+    int             count;
+    strset_slot_t  *slots;
+};
+
+/*
+ * hash a string (times 33, as apr_hash does) and take its length on the
+ * way
+ */
+void
+strset_key(strset_key_t * key, const char *str)
+{
+    const unsigned char *p = (const unsigned char *) str;
+    uint32_t        hash = 0;
+
+    for (; *p; p++)
+        hash = hash * 33 + *p;
+
+    key->str = str;
+    key->len = (const char *) p - str;
+    key->hash = hash;
+}
+
+/*
+ * a set for up to nelts strings, kept at most half full
+ */
+strset_t       *
+strset_make(apr_pool_t * pool, int nelts)
+{
+    strset_t       *set;
+    uint32_t        size = 4;
+
+    while (size < (uint32_t) nelts * 2)
+        size <<= 1;
+
+    set = apr_pcalloc(pool, sizeof(strset_t));
+    set->mask = size - 1;
+    set->slots = apr_pcalloc(pool, sizeof(strset_slot_t) * size);
+
+    return set;
+}
+
+static strset_slot_t *
+strset_slot(const strset_t * set, const strset_key_t * key)
+{
+    uint32_t        i;
+
+    for (i = key->hash & set->mask;; i = (i + 1) & set->mask) {
+        strset_slot_t  *slot = &set->slots[i];
+
+        if (!slot->str ||
+            (slot->hash == key->hash && slot->len == key->len &&
+             !memcmp(slot->str, key->str, key->len)))
+            return slot;
+    }
+}
+
+/*
+ * add a string, which is not copied, with data (not NULL) to return for
+ * it. Adding a string that is already there replaces its data, adding
+ * more strings than the set was made for is not allowed.
+ */
+void
+strset_add(strset_t * set, const char *str, void *data)
+{
+    strset_key_t    key;
+    strset_slot_t  *slot;
+
+    strset_key(&key, str);
+    slot = strset_slot(set, &key);
+
+    if (!slot->str) {
+        slot->hash = key.hash;
+        slot->len = key.len;
+        slot->str = str;
+        set->count++;
+    }
+
+    slot->data = data;
+}
+
+/*
+ * the data of the string key was made from, NULL if it is not in the set
+ */
+void           *
+strset_get(const strset_t * set, const strset_key_t * key)
+{
+    return strset_slot(set, key)->data;
+}
+
+int
+strset_count(const strset_t * set)
+{
+    return set->count;
+}
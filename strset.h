@@ -0,0 +1,34 @@
+/******************************************************************************/
+/* strset.h  -- flat sets of strings probed with a precomputed hash
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#ifndef _STRSET_H
+#define _STRSET_H
+
+#include "apr.h"
+#include "apr_pools.h"
+
+/*
+ * A strset is a fixed size open addressing table of strings, each slot
+ * holding the string's hash and length next to it. It is looked up with
+ * a strset_key_t, a string hashed once by strset_key() which can then be
+ * probed against any number of sets without going over the string again
+ * unless a slot has the very same hash and length.
+ */
+typedef struct strset strset_t;
+
+typedef struct strset_key {
+    const char     *str;
+    apr_size_t      len;
+    uint32_t        hash;
+} strset_key_t;
+
+void strset_key(strset_key_t *, const char *);
+strset_t *strset_make(apr_pool_t *, int);
+void strset_add(strset_t *, const char *, void *);
+void *strset_get(const strset_t *, const strset_key_t *);
+int strset_count(const strset_t *);
+
+#endif                          /* _STRSET_H */
@@ -11,6 +11,7 @@
 #include "apr_hash.h"
 #include "apr_tables.h"
 #include "filter.h"
+#include "filter_image.h"
 
 void print_ip(prefix_t *prefix, void *data)
 {
@@ -63,13 +64,14 @@ void print_rules(filter_t *filter, filter_rule_t *rule)
             }
         }
 
-        rule_flow_t * flow = rule->flow;
-        if (flow) {
+        if (rule->flow) {
+            int i;
+
             printf("Flows:\n");
-            while (flow) {
-                printf("Type:         %d\n", flow->type);
-                flow = flow->next;
-            }
+            for (i = 0; i < rule->flow_len; i++)
+                printf("%3d: Type:    %d true: %d false: %d\n", i,
+                       rule->flow[i].type, rule->flow[i].on_true,
+                       rule->flow[i].on_false);
         }
         printf("\n");
         rule = rule->next;
@@ -103,7 +105,10 @@ main(int argc, char **argv)
     apr_initialize();
     apr_pool_create(&root_pool, NULL);
 
-    filter = filter_parse_config(root_pool, argv[1], 1);
+    if (filter_image_probe(argv[1]))
+        filter = filter_image_load(root_pool, argv[1]);
+    else
+        filter = filter_parse_config(root_pool, argv[1], 1);
 
     printf("Filter passed? %s\n", filter ? "yes" : "no");
 
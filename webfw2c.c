@@ -0,0 +1,57 @@
+/******************************************************************************/
+/* webfw2c.c  -- Compile a filter configuration into a filter image
+ *
+ * Copyright 2007-2013 AOL Inc. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "apr.h"
+#include "apr_pools.h"
+#include "filter.h"
+#include "filter_image.h"
+
+int
+main(int argc, char **argv)
+{
+    filter_t       *filter;
+    filter_t       *image;
+    apr_pool_t     *root_pool;
+    int             ret = 1;
+
+    if (argc != 3) {
+        printf("Usage: %s <config> <image>\n", argv[0]);
+        exit(1);
+    }
+
+    apr_initialize();
+    apr_pool_create(&root_pool, NULL);
+
+    /*
+     * the whitelist-file referenced by the config is compiled into the
+     * image, it is not read again when the image is loaded.
+     */
+    if (!(filter = filter_parse_config(root_pool, argv[1], 1)))
+        fprintf(stderr, "%s: unable to parse %s\n", argv[0], argv[1]);
+    else if (filter_image_write(root_pool, filter, argv[2]) == -1)
+        fprintf(stderr, "%s: unable to write %s\n", argv[0], argv[2]);
+    else if (!(image = filter_image_load(root_pool, argv[2])))
+        fprintf(stderr, "%s: unable to load back %s\n", argv[0], argv[2]);
+    else if (image->rule_count != filter->rule_count ||
+             !image->whitelist_rule != !filter->whitelist_rule)
+        fprintf(stderr, "%s: %s does not match %s\n", argv[0], argv[2],
+                argv[1]);
+    else {
+        printf("Compiled %u rules%s into %s\n", filter->rule_count,
+               filter->whitelist_rule ? " and a whitelist" : "", argv[2]);
+
+        if (filter_regexes_lowered(filter))
+            printf("%u regexes are matched as plain strings\n",
+                   filter_regexes_lowered(filter));
+        ret = 0;
+    }
+
+    apr_pool_destroy(root_pool);
+    apr_terminate();
+    return ret;
+}